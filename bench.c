@@ -0,0 +1,517 @@
+//*****************************************************************************
+//
+//	Copyright 2011 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+//*****************************************************************************
+//
+//	Name	 : bench.c
+//
+//	Project	 : UIO48 Benchmark Program
+//
+//	Measures the library calls, event draining, interrupt to user space
+//	wakeup latency and output update strategies, and prints one line
+//	per measurement as CSV or JSON. Run it against a card, or without
+//	one by setting UIO48_BACKEND=sim.
+//
+//	usage: bench [-c chip] [-b bit] [-n iterations] [-s seconds] [-j]
+//
+//	The event tests toggle the output of bit (default 1) with interrupts
+//	enabled on the same bit, so that bit must be free to drive.
+//	event_drain only reports a rate, its distribution columns are empty.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "uio48.h"
+
+int read_bit(int chip_number, int bit_number);
+int write_bit(int chip_number, int bit_number, int val);
+int set_bit(int chip_number, int bit_number);
+int clr_bit(int chip_number, int bit_number);
+int enab_int(int chip_number, int bit_number, int polarity);
+int disab_int(int chip_number, int bit_number);
+int clr_int(int chip_number, int bit_number);
+int get_int(int chip_number);
+int read_int_pending(int chip_number);
+int read_byte(int chip_number, int port_number);
+int write_byte(int chip_number, int port_number, int val);
+int set_moderation(int chip_number, int count, int usecs);
+int get_moderation(int chip_number, int *count, int *usecs);
+int read_events(int chip_number, struct uio48_event *events, int max_events);
+int read_state(int chip_number, struct uio48_state *state);
+
+typedef unsigned long long u64;
+
+// Command line settings
+int chip = 1;
+int bit = 1;
+int iterations = 100000;
+int seconds = 2;
+int json = 0;
+
+// Number of results printed, for the JSON separators
+int results;
+
+// Shared by the event tests
+volatile int stop_flag;
+volatile int consumers_running;
+u64 drained[4];
+u64 *samples;
+volatile int sample_count;
+int sample_max;
+
+u64 now_ns(void);
+void report(const char *test, int threads, u64 *ns, int n, double seconds);
+void report_rate(const char *test, int threads, u64 n, double seconds);
+void bench_calls(void);
+void bench_outputs(void);
+void bench_drain(int threads);
+void bench_wakeup(void);
+void *drain_thread(void *arg);
+void *wakeup_thread(void *arg);
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while((c = getopt(argc, argv, "c:b:n:s:j")) != -1)
+	{
+		switch(c)
+		{
+		case 'c':
+			chip = atoi(optarg);
+			break;
+		case 'b':
+			bit = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c chip] [-b bit] [-n iterations] "
+					"[-s seconds] [-j]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if(iterations < 1 || bit < 1 || bit > 24 || seconds < 1)
+	{
+		fprintf(stderr, "bit must be 1-24, iterations and seconds positive\n");
+		exit(1);
+	}
+
+	// Do a read_bit to test for port availability
+	if(read_bit(chip, bit) < 0)
+	{
+		fprintf(stderr, "Unable to access UIO48 chip %d - Aborting\n", chip);
+		exit(1);
+	}
+
+	samples = malloc(iterations * sizeof(u64));
+
+	if(samples == NULL)
+	{
+		perror("malloc");
+		exit(1);
+	}
+
+	if(json)
+		printf("[\n");
+	else
+		printf("test,threads,count,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,ops_per_sec\n");
+
+	bench_calls();
+	bench_outputs();
+	bench_drain(1);
+	bench_drain(2);
+	bench_drain(4);
+	bench_wakeup();
+
+	if(json)
+		printf("\n]\n");
+
+	return 0;
+}
+
+u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Print the distribution of n samples. A non-zero elapsed time gives the
+// throughput, otherwise it is derived from the samples.
+void report(const char *test, int threads, u64 *ns, int n, double elapsed)
+{
+	u64 sum = 0;
+	double rate;
+	int i;
+
+	if(n == 0)
+	{
+		fprintf(stderr, "%s: no samples\n", test);
+		return;
+	}
+
+	qsort(ns, n, sizeof(u64), compare_u64);
+
+	for(i = 0; i < n; i++)
+		sum += ns[i];
+
+	rate = elapsed > 0 ? n / elapsed : n / (sum / 1e9);
+
+#define PCT(p) ns[(int)((n - 1) * (p))]
+
+	if(json)
+		printf("%s  {\"test\": \"%s\", \"threads\": %d, \"count\": %d, \"min_ns\": %llu, "
+			   "\"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+			   "\"p999_ns\": %llu, \"max_ns\": %llu, \"ops_per_sec\": %.0f}",
+			   results ? ",\n" : "", test, threads, n, ns[0], sum / n,
+			   PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), ns[n-1], rate);
+	else
+		printf("%s,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.0f\n",
+			   test, threads, n, ns[0], sum / n,
+			   PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), ns[n-1], rate);
+
+#undef PCT
+
+	fflush(stdout);
+	results++;
+}
+
+// Print a throughput with no distribution, for tests that only count
+void report_rate(const char *test, int threads, u64 n, double elapsed)
+{
+	double rate = elapsed > 0 ? n / elapsed : 0;
+
+	if(json)
+		printf("%s  {\"test\": \"%s\", \"threads\": %d, \"count\": %llu, "
+			   "\"ops_per_sec\": %.0f}",
+			   results ? ",\n" : "", test, threads, n, rate);
+	else
+		printf("%s,%d,%llu,,,,,,,,%.0f\n", test, threads, n, rate);
+
+	fflush(stdout);
+	results++;
+}
+
+///**********************************************************************
+//			LIBRARY CALLS
+///**********************************************************************
+
+int op_read_bit(int i)			{ return read_bit(chip, bit); }
+int op_write_bit(int i)			{ return write_bit(chip, bit, i & 1); }
+int op_set_bit(int i)			{ return set_bit(chip, bit); }
+int op_clr_bit(int i)			{ return clr_bit(chip, bit); }
+int op_read_byte(int i)			{ return read_byte(chip, (bit-1) / 8); }
+int op_write_byte(int i)		{ return write_byte(chip, (bit-1) / 8, i & 0xff); }
+int op_get_int(int i)			{ return get_int(chip); }
+int op_read_int_pending(int i)	{ return read_int_pending(chip); }
+int op_clr_int(int i)			{ return clr_int(chip, bit); }
+int op_enab_int(int i)			{ return enab_int(chip, bit, 1); }
+int op_disab_int(int i)			{ return disab_int(chip, bit); }
+
+int op_read_state(int i)
+{
+	struct uio48_state state;
+
+	return read_state(chip, &state);
+}
+
+struct bench_op {
+	const char *name;
+	int (*fn)(int i);
+};
+
+struct bench_op calls[] = {
+	{ "read_bit", op_read_bit },
+	{ "write_bit", op_write_bit },
+	{ "set_bit", op_set_bit },
+	{ "clr_bit", op_clr_bit },
+	{ "read_byte", op_read_byte },
+	{ "write_byte", op_write_byte },
+	{ "get_int", op_get_int },
+	{ "read_int_pending", op_read_int_pending },
+	{ "clr_int", op_clr_int },
+	{ "enab_int", op_enab_int },
+	{ "disab_int", op_disab_int },
+	{ "read_state", op_read_state },
+};
+
+// Time n calls of one operation each
+void run_op(const char *name, int (*fn)(int i))
+{
+	u64 t0, start;
+	int i;
+
+	// the first call may open or map the device
+	if(fn(0) < 0)
+	{
+		fprintf(stderr, "%s: not supported by this backend, skipped\n", name);
+		return;
+	}
+
+	start = now_ns();
+
+	for(i = 0; i < iterations; i++)
+	{
+		t0 = now_ns();
+		fn(i);
+		samples[i] = now_ns() - t0;
+	}
+
+	report(name, 1, samples, iterations, (now_ns() - start) / 1e9);
+}
+
+void bench_calls(void)
+{
+	int i;
+
+	for(i = 0; i < sizeof(calls) / sizeof(calls[0]); i++)
+		run_op(calls[i].name, calls[i].fn);
+
+	disab_int(chip, bit);
+}
+
+///**********************************************************************
+//			OUTPUT UPDATES
+// Each operation changes all 8 bits of the port holding the test bit,
+// using a different strategy.
+///**********************************************************************
+
+int op_port_bitwise(int i)
+{
+	int port = (bit-1) / 8, j, c = 0;
+
+	for(j = 1; j <= 8; j++)
+		c |= write_bit(chip, port * 8 + j, (i >> (j & 1)) & 1);
+
+	return c;
+}
+
+int op_port_byte(int i)
+{
+	return write_byte(chip, (bit-1) / 8, i & 1 ? 0x55 : 0xaa);
+}
+
+int op_port_masked(int i)
+{
+	static struct uio48_batch batch;
+
+	batch_init(&batch, chip);
+	batch_write_masked(&batch, (bit-1) / 8, 0xff, i & 1 ? 0x55 : 0xaa);
+
+	return batch_submit(&batch);
+}
+
+int op_port_transaction(int i)
+{
+	int port = (bit-1) / 8, j;
+
+	if(begin_transaction(chip))
+		return -1;
+
+	for(j = 1; j <= 8; j++)
+		write_bit(chip, port * 8 + j, (i >> (j & 1)) & 1);
+
+	return commit_transaction(chip);
+}
+
+void bench_outputs(void)
+{
+	run_op("port_bitwise", op_port_bitwise);
+	run_op("port_byte", op_port_byte);
+	run_op("port_masked", op_port_masked);
+	run_op("port_transaction", op_port_transaction);
+
+	write_byte(chip, (bit-1) / 8, 0);
+}
+
+///**********************************************************************
+//			EVENTS
+///**********************************************************************
+
+// Consume events until told to stop
+void *drain_thread(void *arg)
+{
+	struct uio48_event events[64];
+	int id = (long)arg;
+	int n;
+
+	while(!stop_flag)
+	{
+		n = read_events(chip, events, 64);
+
+		if(n < 0)
+			break;
+
+		drained[id] += n;
+	}
+
+	__atomic_sub_fetch(&consumers_running, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+// Event drain throughput. The main thread toggles the test bit as fast
+// as it can for the run time while the consumers drain.
+void bench_drain(int threads)
+{
+	pthread_t tids[4];
+	u64 start, total = 0;
+	double elapsed;
+	int count, usecs, saved;
+	int i, x;
+
+	// Every event wakes the consumers, the chip's setting is put back after
+	saved = get_moderation(chip, &count, &usecs) == 0;
+	set_moderation(chip, 1, 0);
+	enab_int(chip, bit, 1);
+	clr_int(chip, bit);
+
+	while(get_int(chip))
+		;
+
+	stop_flag = 0;
+	consumers_running = threads;
+
+	for(i = 0; i < threads; i++)
+	{
+		drained[i] = 0;
+		pthread_create(&tids[i], NULL, drain_thread, (void *)(long)i);
+	}
+
+	start = now_ns();
+
+	for(x = 0; now_ns() - start < seconds * 1000000000ULL; x++)
+		write_bit(chip, bit, x & 1);
+
+	elapsed = (now_ns() - start) / 1e9;
+	stop_flag = 1;
+
+	// Keep producing until every consumer left its blocking read
+	while(__atomic_load_n(&consumers_running, __ATOMIC_SEQ_CST))
+		write_bit(chip, bit, ++x & 1);
+
+	for(i = 0; i < threads; i++)
+	{
+		pthread_join(tids[i], NULL);
+		total += drained[i];
+	}
+
+	disab_int(chip, bit);
+	clr_bit(chip, bit);
+
+	while(get_int(chip))
+		;
+
+	if(saved)
+		set_moderation(chip, count, usecs);
+
+	// Reads return batches, so only the overall rate is meaningful
+	report_rate("event_drain", threads, total, elapsed);
+}
+
+// Record the delay from the latch timestamp to the return of read()
+void *wakeup_thread(void *arg)
+{
+	struct uio48_event events[8];
+	u64 now;
+	int n, i;
+
+	while(!stop_flag)
+	{
+		n = read_events(chip, events, 8);
+		now = now_ns();
+
+		for(i = 0; i < n; i++)
+			if(sample_count < sample_max)
+				samples[sample_count++] = now - events[i].timestamp;
+	}
+
+	__atomic_sub_fetch(&consumers_running, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+// Wakeup latency from the interrupt to user space. The edges are paced
+// far enough apart that every one finds the consumer asleep.
+void bench_wakeup(void)
+{
+	struct timespec gap = { 0, 200000 };
+	pthread_t tid;
+	int count, usecs, saved;
+	int x;
+
+	saved = get_moderation(chip, &count, &usecs) == 0;
+	set_moderation(chip, 1, 0);
+	enab_int(chip, bit, 1);
+	clr_bit(chip, bit);
+
+	while(get_int(chip))
+		;
+
+	stop_flag = 0;
+	consumers_running = 1;
+	sample_count = 0;
+	sample_max = iterations < 10000 ? iterations : 10000;
+
+	pthread_create(&tid, NULL, wakeup_thread, NULL);
+
+	for(x = 0; sample_count < sample_max && x < 4 * sample_max; x++)
+	{
+		set_bit(chip, bit);
+		nanosleep(&gap, NULL);
+		clr_bit(chip, bit);
+		nanosleep(&gap, NULL);
+	}
+
+	stop_flag = 1;
+
+	while(__atomic_load_n(&consumers_running, __ATOMIC_SEQ_CST))
+		write_bit(chip, bit, ++x & 1);
+
+	pthread_join(tid, NULL);
+
+	disab_int(chip, bit);
+	clr_bit(chip, bit);
+
+	if(saved)
+		set_moderation(chip, count, usecs);
+
+	report("wakeup_latency", 1, samples, sample_count, 0);
+}
@@ -0,0 +1,336 @@
+//*****************************************************************************
+//
+//	Copyright 2011 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+//*****************************************************************************
+//
+//	Name	 : record.c
+//
+//	Project	 : UIO48 Event Recorder (uio48-record)
+//
+//	Streams the events and periodic pin snapshots of one or more chips
+//	into a trace file (see struct uio48_trace_header in uio48.h) until
+//	interrupted or the run time is up. Replay it into the simulated
+//	backend with uio48-replay, or run an application against it with
+//	UIO48_BACKEND=sim UIO48_SIM_REPLAY=<file>.
+//
+//	usage: uio48-record [-c chips] [-s snapshot_ms] [-t seconds] [-q] file
+//
+//	chips is a list such as 1,2 (default 1). The interrupts to record
+//	must already be enabled by the application being observed.
+//
+//	The events are read from the aggregate node, which gets its own copy
+//	of every event, so the application keeps reading its chips as usual
+//	and their moderation is left alone. Events are only copied there
+//	once the recorder has the node open, so start it before the
+//	application.
+//
+//	-q reads each chip's own queue instead, for drivers or backends
+//	without the aggregate node. The recorder then has to be the only
+//	consumer: an application reading the same chip gets only the events
+//	the recorder did not. The chips' moderation is raised for batched
+//	reads while recording and put back on exit.
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "uio48.h"
+
+int read_byte(int chip_number, int port_number);
+int set_moderation(int chip_number, int count, int usecs);
+int get_moderation(int chip_number, int *count, int *usecs);
+int read_events(int chip_number, struct uio48_event *events, int max_events);
+int read_all_events(struct uio48_event *events, int max_events);
+int read_state(int chip_number, struct uio48_state *state);
+
+// Events per read() and, with -q, the moderation that lets them accumulate
+#define BATCH		256
+#define BATCH_USECS	1000
+
+unsigned chips;
+FILE *out;
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long records;
+volatile sig_atomic_t stop_flag;
+
+unsigned long long now_ns(void);
+void write_records(struct uio48_trace_record *recs, int n);
+void write_events(struct uio48_event *events, int n);
+void snapshot(int chip);
+void *reader_thread(void *arg);
+void *all_reader_thread(void *arg);
+
+void stop(int sig)
+{
+	stop_flag = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct uio48_trace_header hdr;
+	struct uio48_state state;
+	struct timespec gap;
+	pthread_t tid;
+	unsigned overruns[MAX_CHIPS];
+	int mod_count[MAX_CHIPS], mod_usecs[MAX_CHIPS], saved[MAX_CHIPS];
+	unsigned long long end = 0;
+	int snap_ms = 100, queues = 0, c, x;
+	char *p;
+
+	while((c = getopt(argc, argv, "c:s:t:q")) != -1)
+	{
+		switch(c)
+		{
+		case 'c':
+			for(p = optarg; *p; p++)
+				if(*p >= '1' && *p < '1' + MAX_CHIPS)
+					chips |= 1 << (*p - '1');
+			break;
+		case 's':
+			snap_ms = atoi(optarg);
+			break;
+		case 't':
+			end = atoi(optarg) * 1000000000ULL;
+			break;
+		case 'q':
+			queues = 1;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if(optind != argc - 1 || snap_ms <= 0)
+	{
+		fprintf(stderr, "usage: %s [-c chips] [-s snapshot_ms] [-t seconds] [-q] file\n",
+				argv[0]);
+		exit(1);
+	}
+
+	if(chips == 0)
+		chips = 1;
+
+	out = fopen(argv[optind], "wb");
+
+	if(out == NULL)
+	{
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	// Writes reach the disk in large blocks
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = UIO48_TRACE_MAGIC;
+	hdr.version = UIO48_TRACE_VERSION;
+	hdr.record_size = sizeof(struct uio48_trace_record);
+	hdr.chips = chips;
+	hdr.start_ns = now_ns();
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	if(end)
+		end += hdr.start_ns;
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	// Check every chip before starting on any
+	for(x = 0; x < MAX_CHIPS; x++)
+	{
+		if(((chips >> x) & 1) && read_byte(x + 1, 0) < 0)
+		{
+			fprintf(stderr, "Unable to access UIO48 chip %d - Aborting\n", x + 1);
+			exit(1);
+		}
+	}
+
+	for(x = 0; x < MAX_CHIPS; x++)
+	{
+		if(!((chips >> x) & 1))
+			continue;
+
+		overruns[x] = read_state(x + 1, &state) ? 0 : state.overruns;
+		saved[x] = 0;
+
+		snapshot(x);
+
+		if(!queues)
+			continue;
+
+		// Let events pile up for a batched read, but not for long
+		saved[x] = get_moderation(x + 1, &mod_count[x], &mod_usecs[x]) == 0;
+		set_moderation(x + 1, BATCH / 4, BATCH_USECS);
+
+		pthread_create(&tid, NULL, reader_thread, (void *)(long)x);
+		pthread_detach(tid);
+	}
+
+	if(!queues)
+	{
+		pthread_create(&tid, NULL, all_reader_thread, NULL);
+		pthread_detach(tid);
+	}
+
+	gap.tv_sec = snap_ms / 1000;
+	gap.tv_nsec = (snap_ms % 1000) * 1000000L;
+
+	while(!stop_flag && (end == 0 || now_ns() < end))
+	{
+		nanosleep(&gap, NULL);
+
+		for(x = 0; x < MAX_CHIPS; x++)
+			if((chips >> x) & 1)
+				snapshot(x);
+	}
+
+	// The readers may be blocked in read(), leave them there
+	pthread_mutex_lock(&out_lock);
+	fclose(out);
+
+	fprintf(stderr, "%llu records written\n", records);
+
+	for(x = 0; x < MAX_CHIPS; x++)
+	{
+		if(((chips >> x) & 1) && saved[x])
+			set_moderation(x + 1, mod_count[x], mod_usecs[x]);
+
+		if(((chips >> x) & 1) && read_state(x + 1, &state) == 0 &&
+		   state.overruns != overruns[x])
+			fprintf(stderr, "chip %d: %u events lost in the driver\n", x + 1,
+					state.overruns - overruns[x]);
+	}
+
+	exit(0);
+}
+
+unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void write_records(struct uio48_trace_record *recs, int n)
+{
+	pthread_mutex_lock(&out_lock);
+
+	if(!stop_flag)
+	{
+		fwrite(recs, sizeof(*recs), n, out);
+		records += n;
+	}
+
+	pthread_mutex_unlock(&out_lock);
+}
+
+// Record the pin levels of all ports
+void snapshot(int chip)
+{
+	struct uio48_trace_record rec;
+	int port;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = UIO48_TRACE_SNAPSHOT;
+	rec.chip = chip;
+	rec.timestamp = now_ns();
+
+	for(port = 0; port < 6; port++)
+		rec.ports[port] = read_byte(chip + 1, port);
+
+	write_records(&rec, 1);
+}
+
+// Turn events into trace records, dropping those of unrecorded chips
+void write_events(struct uio48_event *events, int n)
+{
+	struct uio48_trace_record recs[BATCH];
+	int i, count = 0;
+
+	memset(recs, 0, n * sizeof(recs[0]));
+
+	for(i = 0; i < n; i++)
+	{
+		if(!((chips >> events[i].chip) & 1))
+			continue;
+
+		recs[count].timestamp = events[i].timestamp;
+		recs[count].type = UIO48_TRACE_EVENT;
+		recs[count].chip = events[i].chip;
+		recs[count].bit = events[i].bit;
+		recs[count].flags = events[i].flags;
+		count++;
+	}
+
+	if(count)
+		write_records(recs, count);
+}
+
+// Drain the events of every chip from the aggregate node
+void *all_reader_thread(void *arg)
+{
+	struct uio48_event events[BATCH];
+	int n;
+
+	while(!stop_flag)
+	{
+		n = read_all_events(events, BATCH);
+
+		if(n < 0)
+		{
+			fprintf(stderr, "Unable to read /dev/uio48all, use -q without it\n");
+			stop_flag = 1;
+			break;
+		}
+
+		write_events(events, n);
+	}
+
+	return NULL;
+}
+
+// Drain the events of one chip a batch at a time, with -q
+void *reader_thread(void *arg)
+{
+	struct uio48_event events[BATCH];
+	int chip = (long)arg;
+	int n;
+
+	while(!stop_flag)
+	{
+		n = read_events(chip + 1, events, BATCH);
+
+		if(n < 0)
+		{
+			perror("read_events");
+			stop_flag = 1;
+			break;
+		}
+
+		write_events(events, n);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,186 @@
+//*****************************************************************************
+//
+//	Copyright 2011 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+//*****************************************************************************
+//
+//	Name	 : replay.c
+//
+//	Project	 : UIO48 Trace Replay (uio48-replay)
+//
+//	Plays a trace written by uio48-record into the simulated backend and
+//	prints the events the simulated chips raise, to check a trace before
+//	rerunning an application on it. Applications replay a trace directly
+//	with UIO48_BACKEND=sim UIO48_SIM_REPLAY=<file> [UIO48_SIM_SPEED=<x>].
+//
+//	usage: uio48-replay [-x speed] file
+//
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "uio48.h"
+
+int enab_int(int chip_number, int bit_number, int polarity);
+int get_int(int chip_number);
+
+unsigned chips;
+volatile int done;
+
+// Wait for every waveform to finish
+void *wait_thread(void *arg)
+{
+	int x;
+
+	for(x = 0; x < MAX_CHIPS; x++)
+		if((chips >> x) & 1)
+			uio48sim_wait(x + 1);
+
+	done = 1;
+
+	return NULL;
+}
+
+// Print the queued events. Returns how many there were.
+int drain(void)
+{
+	int x, bit, n = 0;
+
+	for(x = 0; x < MAX_CHIPS; x++)
+	{
+		if(!((chips >> x) & 1))
+			continue;
+
+		while((bit = get_int(x + 1)) > 0)
+		{
+			printf("chip %d bit %d\n", x + 1, bit);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct uio48_trace_header *hdr;
+	const struct uio48_trace_record *rec;
+	unsigned char enabled[MAX_CHIPS][49] = {{0}};
+	unsigned long long seen = 0, expected = 0, ignored = 0;
+	double speed = 1.0;
+	struct stat st;
+	pthread_t tid;
+	size_t count, i;
+	int fd, c, x, bit, polarity;
+
+	while((c = getopt(argc, argv, "x:")) != -1)
+	{
+		if(c == 'x')
+			speed = atof(optarg);
+		else
+			optind = argc;
+	}
+
+	if(optind != argc - 1 || speed <= 0)
+	{
+		fprintf(stderr, "usage: %s [-x speed] file\n", argv[0]);
+		exit(1);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+
+	if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+	{
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if(hdr == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+
+	if(hdr->magic != UIO48_TRACE_MAGIC || hdr->version != UIO48_TRACE_VERSION ||
+	   hdr->record_size != sizeof(*rec))
+	{
+		fprintf(stderr, "%s is not a UIO48 trace\n", argv[optind]);
+		exit(1);
+	}
+
+	rec = (const struct uio48_trace_record *)(hdr + 1);
+	count = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+
+	chips = hdr->chips;
+
+	uio48_set_backend(&uio48_sim_backend);
+
+	// Enable every recorded bit, with the polarity of its first edge. Only
+	// edges of that polarity can be raised again, so only those count.
+	for(i = 0; i < count; i++)
+	{
+		x = rec[i].chip;
+		bit = rec[i].bit;
+
+		if(rec[i].type != UIO48_TRACE_EVENT || x >= MAX_CHIPS || bit < 1 || bit > 48 ||
+		   !(rec[i].flags & (UIO48_EVENT_RISING | UIO48_EVENT_FALLING)))
+			continue;
+
+		polarity = (rec[i].flags & UIO48_EVENT_RISING) ? 2 : 1;
+
+		if(enabled[x][bit] == 0)
+		{
+			enab_int(x + 1, bit, polarity == 2);
+			enabled[x][bit] = polarity;
+		}
+
+		if(enabled[x][bit] == polarity)
+			expected++;
+		else
+			ignored++;
+	}
+
+	printf("%zu records, %llu edges to raise, %llu of the other polarity, chips %x, replaying at %gx\n",
+		   count, expected, ignored, hdr->chips, speed);
+
+	if(uio48sim_replay(argv[optind], speed, 1) < 0)
+	{
+		fprintf(stderr, "Unable to replay %s\n", argv[optind]);
+		exit(1);
+	}
+
+	pthread_create(&tid, NULL, wait_thread, NULL);
+
+	while(!done)
+	{
+		seen += drain();
+		usleep(1000);
+	}
+
+	pthread_join(tid, NULL);
+	seen += drain();
+
+	printf("%llu of %llu recorded edges raised again\n", seen, expected);
+
+	return 0;
+}
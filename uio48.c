@@ -22,9 +22,41 @@
 #include <linux/cdev.h>
 #include <linux/io.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/uaccess.h>
+#include <linux/completion.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/capability.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/eventfd.h>
+#include <linux/indirect_call_wrapper.h>
+#include <linux/version.h>
+
+// IORING_OP_URING_CMD, with issue_flags on completion since 6.3
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define UIO48_HAVE_URING
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Pending uring commands can be cancelled when the ring exits since 6.7.
+// Without that a wait could hold up the exit, so waits need it.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#define UIO48_HAVE_URING_CANCEL
+#endif
 
 #include "uio48.h"
 
+#define CREATE_TRACE_POINTS
+#include "uio48_trace.h"
+
 #define MOD_DESC "WinSystems, Inc. UIO48 Digital I/O Driver"
 MODULE_LICENSE("GPL v2");
 MODULE_DESCRIPTION(MOD_DESC);
@@ -32,39 +64,215 @@ MODULE_AUTHOR("Paul DeMetrotion");
 
 // ******************* Device Declarations *****************************
 
-#define MAX_INTS 1024
+#define MAX_INTS 1024	// must be a power of 2
+
+// One-shot output pulses in flight at the same time
+#define MAX_PULSES	16
+
+// Longest pulse accepted by IOCTL_PULSE
+#define MAX_PULSE_US	10000000
+
+struct uio48_dev;
+
+struct uio48_pulse_slot {
+	struct hrtimer timer;
+	struct uio48_dev *uiodev;
+	u64 mask;		// 0 when the slot is free
+	int polarity;
+	int notify;
+};
+
+// Software PWM period limits
+#define MIN_PWM_PERIOD_US	100
+#define MAX_PWM_PERIOD_US	10000000
+
+struct uio48_pwm_chan {
+	u64 next;		// time of the next edge, ns
+	u64 high_ns;
+	u64 low_ns;
+	int level;
+};
+
+// Quadrature decoder on a pair of interrupt capable inputs
+struct uio48_enc {
+	int enabled;
+	int bit_a;		// 0 based
+	int bit_b;
+	int state;		// last A/B levels, A in bit 1
+	s64 position;
+	u32 errors;
+};
+
+// A task sleeping in IOCTL_WAIT_PATTERN
+struct uio48_pattern_waiter {
+	struct list_head list;
+	u64 mask;
+	u64 value;
+	struct completion done;
+};
+
+// Register access. Ports are absolute I/O addresses in both backends.
+struct uio48_io_ops {
+	u8 (*inb)(struct uio48_dev *uiodev, unsigned port);
+	void (*outb)(struct uio48_dev *uiodev, u8 val, unsigned port);
+};
+
+// In-memory register file of a fake device, see fake_inb()/fake_outb()
+struct uio48_fake {
+	spinlock_t lock;
+	u8 latch[6];		// output latches
+	u8 input[6];		// levels injected through debugfs
+	u8 page_lock;		// +7
+	u8 pol[3];		// page 1
+	u8 enab[3];		// page 2
+	u8 int_id[3];		// page 3
+};
+
+// log2 latency histogram, bucket i counts [2^i, 2^(i+1)) ns
+#define HIST_BUCKETS	32
+
+struct uio48_hist {
+	atomic_long_t buckets[HIST_BUCKETS];
+};
+
+struct uio48_ring {
+	struct uio48_event buf[MAX_INTS];
+	int inptr;
+	int outptr;
+};
 
 struct uio48_dev {
 	char name[32];
+	int chip;
 	unsigned irq;
-	unsigned char int_buffer[MAX_INTS];
-	int inptr;
-	int outptr;
+	struct uio48_ring ring;
+	unsigned overruns;
+	unsigned mod_count;
+	unsigned mod_usecs;
+	int exclusive;		// UIO48_WAIT_EXCLUSIVE
+	struct hrtimer mod_timer;
+	struct hrtimer poll_timer;
+	ktime_t poll_period;
+	struct hrtimer cos_timer;	// forwarded and started under spnlck only
+	ktime_t cos_period;
 	wait_queue_head_t wq;
 	struct mutex mtx;
 	spinlock_t spnlck;
 	struct cdev cdev;
 	unsigned base_port;
-	unsigned char port_images[6];
-	int ready;
+	spinlock_t img_lock;		// pulse and PWM bookkeeping
+	spinlock_t port_lock[6];	// output image and write of each port
+	spinlock_t state_lock;
+	struct uio48_state *state;
+	struct uio48_shadow *shadow;
+	struct uio48_pulse_slot pulses[MAX_PULSES];
+	u64 pulse_mask;
+	struct uio48_pwm_chan pwm[48];
+	u64 pwm_mask;
+	struct hrtimer pwm_timer;
 	unsigned char lock_image;
 	unsigned char irq_image[3];
+	unsigned char enab_image[6];	// enab, pol and input images are
+	unsigned char pol_image[6];	// written under spnlck, the ISR and
+	unsigned char input_image[6];	// the cos sampler read them there
+	struct list_head pattern_waiters;
+	u64 pattern_mask;
+	struct uio48_enc enc[UIO48_MAX_ENCODERS];
+	u32 enc_mask;
+	const struct uio48_io_ops *io;
+	struct uio48_fake *fake;
+	struct dentry *dbg;
+	char bench_result[128];
+	struct uio48_hist isr_hist;	// irq_handler run time
+	struct uio48_hist event_hist;	// event timestamp to dequeue
+	struct uio48_hist port_hold_hist;	// port_lock hold time
+	struct uio48_hist page_hold_hist;	// spnlck hold for page sequences
+	struct eventfd_ctx *evfd;	// IOCTL_SET_EVENTFD, under spnlck
+	unsigned unsignalled;		// events queued since the last signal
+	struct fasync_struct *async_queue;
+	struct list_head uring_waits;	// pending UIO48_URING_WAIT, under spnlck
 };
 
 // Function prototypes for local functions
+static void init_dev(struct uio48_dev *uiodev, int chip);
+static int alloc_dev(struct uio48_dev *uiodev, int fake);
+static void free_dev(struct uio48_dev *uiodev);
 static void init_io(struct uio48_dev *uiodev, unsigned base_port);
 static int read_bit(struct uio48_dev *uiodev, int bit_number);
+static void update_port(struct uio48_dev *uiodev, int port, unsigned mask, unsigned val);
+static void __update_port(struct uio48_dev *uiodev, int port, unsigned mask, unsigned val);
+static void flush_port(struct uio48_dev *uiodev, int port);
 static void write_bit(struct uio48_dev *uiodev, int bit_number, int val);
+static int start_pulse(struct uio48_dev *uiodev, struct uio48_pulse *req);
+static int set_pwm(struct uio48_dev *uiodev, struct uio48_pwm *req);
+static u64 pwm_next_edge(struct uio48_dev *uiodev);
 static void UIO48_set_bit(struct uio48_dev *uiodev, int bit_num);
 static void clr_bit(struct uio48_dev *uiodev, int bit_num);
 static void enab_int(struct uio48_dev *uiodev, int bit_number, int polarity);
 static void disab_int(struct uio48_dev *uiodev, int bit_number);
+static void enab_cos(struct uio48_dev *uiodev, int bit_number, int polarity);
+static void disab_cos(struct uio48_dev *uiodev, int bit_number);
 static void clr_int(struct uio48_dev *uiodev, int bit_number);
 static int get_int(struct uio48_dev *uiodev);
 static int get_buffered_int(struct uio48_dev *uiodev);
+static int get_events(struct uio48_dev *uiodev, struct uio48_event *evs, int max);
+static bool events_due(struct uio48_dev *uiodev);
+static bool __events_due(struct uio48_dev *uiodev);
+static void queue_event(struct uio48_dev *uiodev, int bit_number, u64 timestamp,
+			int flags);
+static void moderate(struct uio48_dev *uiodev);
+static void notify_events(struct uio48_dev *uiodev);
+static int wait_exclusive(struct uio48_dev *uiodev);
+static void pass_wakeup(struct uio48_dev *uiodev);
+static int set_eventfd(struct uio48_dev *uiodev, int fd);
+static u64 read_inputs(struct uio48_dev *uiodev, u64 mask);
+static void check_patterns(struct uio48_dev *uiodev, u64 state);
+static int wait_pattern(struct uio48_dev *uiodev, u64 mask, u64 value,
+			unsigned timeout_ms);
+static unsigned __update_paged(struct uio48_dev *uiodev, int page, int port,
+			       unsigned mask, unsigned val);
+static void service_encoders(struct uio48_dev *uiodev);
+static int set_encoder(struct uio48_dev *uiodev, struct uio48_encoder *req);
+static int get_encoder(struct uio48_dev *uiodev, struct uio48_encoder *req);
+static void state_begin(struct uio48_dev *uiodev);
+static void state_end(struct uio48_dev *uiodev);
+static void publish_images(struct uio48_dev *uiodev);
+static void publish_encoders(struct uio48_dev *uiodev);
 static void clr_int_id(struct uio48_dev *uiodev, int port_number);
 static void lock_port(struct uio48_dev *uiodev, int port_number);
 static void unlock_port(struct uio48_dev *uiodev, int port_number);
+static int run_cmd_list(struct uio48_dev *uiodev, struct uio48_cmd_list *list);
+static void uio48_debugfs_init(struct uio48_dev *uiodev);
+static void hist_add(struct uio48_hist *hist, u64 ns);
+static void agg_queue(const struct uio48_event *ev);
+static void uring_notify(struct uio48_dev *uiodev);
+static int run_cmd(struct uio48_dev *uiodev, struct uio48_cmd *cmd);
+
+static u8 hw_inb(struct uio48_dev *uiodev, unsigned port)
+{
+	return inb(port);
+}
+
+static void hw_outb(struct uio48_dev *uiodev, u8 val, unsigned port)
+{
+	outb(val, port);
+}
+
+static const struct uio48_io_ops hw_io_ops = {
+	.inb = hw_inb,
+	.outb = hw_outb,
+};
+
+// Keep the hardware case a direct call, the ISR sits on this path
+static inline u8 uio_inb(struct uio48_dev *uiodev, unsigned port)
+{
+	return INDIRECT_CALL_1(uiodev->io->inb, hw_inb, uiodev, port);
+}
+
+static inline void uio_outb(struct uio48_dev *uiodev, u8 val, unsigned port)
+{
+	INDIRECT_CALL_1(uiodev->io->outb, hw_outb, uiodev, val, port);
+}
 
 // Driver major number
 static int uio48_init_major;	// 0 = allocate dynamically
@@ -84,8 +292,132 @@ module_param_array(io, uint, NULL, S_IRUGO);
 MODULE_PARM_DESC(irq, "Array of IRQ routes for devices");
 module_param_array(irq, uint, NULL, S_IRUGO);
 
+// Polling period used for devices without an IRQ
+#define DEFAULT_POLL_US	1000
+
+static unsigned poll_us[MAX_CHIPS];
+
+MODULE_PARM_DESC(poll_us, "Array of polling periods in usecs for devices with no IRQ (default 1000)");
+module_param_array(poll_us, uint, NULL, S_IRUGO);
+
+// Sampling period for change-of-state detection on ports 3-5
+#define DEFAULT_COS_US	1000
+
+static unsigned cos_us[MAX_CHIPS];
+
+MODULE_PARM_DESC(cos_us, "Array of change-of-state sampling periods in usecs for bits 25-48 (default 1000)");
+module_param_array(cos_us, uint, NULL, S_IRUGO);
+
+// Devices backed by the in-memory fake instead of hardware
+#define FAKE_BASE	0x1000
+
+static bool fake[MAX_CHIPS];
+
+MODULE_PARM_DESC(fake, "Array of flags, Y to run a device on an in-memory fake of the registers");
+module_param_array(fake, bool, NULL, S_IRUGO);
+
+static bool lock_stats;
+
+MODULE_PARM_DESC(lock_stats, "Y to record lock hold times in the debugfs histograms");
+module_param(lock_stats, bool, S_IRUGO | S_IWUSR);
+
+// Start and end of a timed lock hold, only clocked with lock_stats set
+static inline u64 lock_clock(void)
+{
+	return READ_ONCE(lock_stats) ? ktime_get_ns() : 0;
+}
+
+static inline void lock_held(struct uio48_hist *hist, u64 start)
+{
+	if (start)
+		hist_add(hist, ktime_get_ns() - start);
+}
+
+// Every taker of spnlck and mtx goes through these, so the lock events
+// bracket each hold. The irqsave one is a macro like spin_lock_irqsave.
+#define uio48_spnlck_lock_irqsave(uiodev, flags)				\
+	do {								\
+		spin_lock_irqsave(&(uiodev)->spnlck, flags);		\
+		trace_uio48_lock_acquire((uiodev)->chip, UIO48_LOCK_SPNLCK); \
+	} while (0)
+
+static inline void uio48_spnlck_unlock_irqrestore(struct uio48_dev *uiodev, unsigned long flags)
+{
+	trace_uio48_lock_release(uiodev->chip, UIO48_LOCK_SPNLCK);
+	spin_unlock_irqrestore(&uiodev->spnlck, flags);
+}
+
+static inline void uio48_spnlck_lock_irq(struct uio48_dev *uiodev)
+{
+	spin_lock_irq(&uiodev->spnlck);
+	trace_uio48_lock_acquire(uiodev->chip, UIO48_LOCK_SPNLCK);
+}
+
+static inline void uio48_spnlck_unlock_irq(struct uio48_dev *uiodev)
+{
+	trace_uio48_lock_release(uiodev->chip, UIO48_LOCK_SPNLCK);
+	spin_unlock_irq(&uiodev->spnlck);
+}
+
+// For the handlers, which already run with interrupts off
+static inline void uio48_spnlck_lock(struct uio48_dev *uiodev)
+{
+	spin_lock(&uiodev->spnlck);
+	trace_uio48_lock_acquire(uiodev->chip, UIO48_LOCK_SPNLCK);
+}
+
+static inline void uio48_spnlck_unlock(struct uio48_dev *uiodev)
+{
+	trace_uio48_lock_release(uiodev->chip, UIO48_LOCK_SPNLCK);
+	spin_unlock(&uiodev->spnlck);
+}
+
+// Returns -EINTR like mutex_lock_interruptible, nothing is traced then
+static inline int uio48_mtx_lock(struct uio48_dev *uiodev)
+{
+	if (mutex_lock_interruptible(&uiodev->mtx))
+		return -EINTR;
+
+	trace_uio48_lock_acquire(uiodev->chip, UIO48_LOCK_MTX);
+	return 0;
+}
+
+static inline void uio48_mtx_unlock(struct uio48_dev *uiodev)
+{
+	trace_uio48_lock_release(uiodev->chip, UIO48_LOCK_MTX);
+	mutex_unlock(&uiodev->mtx);
+}
+
 static struct uio48_dev uiodevs[MAX_CHIPS];
 
+// The aggregate node, minor MAX_CHIPS, merges the events of every chip
+// into one ring in arrival order while it is open
+struct uio48_agg {
+	struct uio48_ring ring;
+	unsigned overruns;
+	atomic_t readers;		// open files, nothing is copied without one
+	spinlock_t lock;		// nests inside each chip's spnlck
+	wait_queue_head_t wq;
+	struct cdev cdev;
+	int registered;
+};
+
+static struct uio48_agg agg = {
+	.lock = __SPIN_LOCK_UNLOCKED(agg.lock),
+	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(agg.wq),
+};
+
+static struct dentry *uio48_debugfs;
+
+// Quadrature step for (previous A/B << 2 | new A/B). 2 flags an invalid
+// transition where both inputs changed.
+static const s8 quad_table[16] = {
+	 0, +1, -1,  2,
+	-1,  0,  2, +1,
+	+1,  2,  0, -1,
+	 2, -1, +1,  0,
+};
+
 static struct class *uio48_class;
 static dev_t uio48_devno;
 
@@ -93,43 +425,287 @@ static dev_t uio48_devno;
 static irqreturn_t irq_handler(int __irq, void *dev_id)
 {
     struct uio48_dev *uiodev = dev_id;
+    u64 now = ktime_get_ns();
+    u64 state;
+    u32 pending = 0;
     int i, j;
-    bool irq = false;
+
+    trace_uio48_irq_entry(uiodev->chip, __irq);
 
     if(get_int(uiodev))
     {
+        pending = uiodev->irq_image[0] | uiodev->irq_image[1] << 8 |
+                  uiodev->irq_image[2] << 16;
+
+        uio48_spnlck_lock(uiodev);
+
+        // Latch the ports that interrupted, plus any a pattern waiter watches
+        for (i = 0; i < 3; i++)
+        {
+            if (uiodev->irq_image[i] || ((uiodev->pattern_mask >> (i * 8)) & 0xff))
+                uiodev->input_image[i] = uio_inb(uiodev, uiodev->base_port + i);
+        }
+
+        state_begin(uiodev);
+        memcpy(uiodev->state->input_image, uiodev->input_image, 3);
+        uiodev->state->input_timestamp = now;
+        state_end(uiodev);
+
         for (i = 0; i < 3; i++) 
         {	
             if (uiodev->irq_image[i] != 0)
             {
-                irq = true;  // at least one irq
-
                 for (j = 0; j < 8; j++)
                 {
-                    if ((uiodev->irq_image[i] >> j) & 1)
-                    {
-                        uiodev->int_buffer[uiodev->inptr++] = (i * 8) + j + 1;
+                    // encoder inputs are decoded below, not queued
+                    if ((uiodev->enc_mask >> ((i * 8) + j)) & 1)
+                        continue;
 
-                        if (uiodev->inptr == MAX_INTS)
-                            uiodev->inptr = 0;
-                    }
+                    if ((uiodev->irq_image[i] >> j) & 1)
+                        queue_event(uiodev, (i * 8) + j + 1, now,
+                                    ((uiodev->pol_image[i] >> j) & 1) ?
+                                    UIO48_EVENT_RISING : UIO48_EVENT_FALLING);
                 }
             }
             else
                 continue;
         }
 
-        if (!uiodev->ready)
+        if (uiodev->enc_mask & (uiodev->irq_image[0] | uiodev->irq_image[1] << 8 |
+                                uiodev->irq_image[2] << 16))
+            service_encoders(uiodev);
+
+        moderate(uiodev);
+
+        // Re-evaluate pattern waiters against the latched port state
+        if (uiodev->pattern_mask)
         {
-            uiodev->ready = 1;
-            wake_up(&uiodev->wq);
+            state = read_inputs(uiodev, uiodev->pattern_mask & ~0xffffffULL);
+
+            for (i = 0; i < 3; i++)
+                state |= (u64)uiodev->input_image[i] << (i * 8);
+
+            check_patterns(uiodev, state);
         }
+
+        uio48_spnlck_unlock(uiodev);
+
+        hist_add(&uiodev->isr_hist, ktime_get_ns() - now);
     }
-    
+
+    trace_uio48_irq_exit(uiodev->chip, pending);
+
     return IRQ_HANDLED;
 
 }
 
+/* Polled mode, for devices without an IRQ */
+static enum hrtimer_restart poll_timer_handler(struct hrtimer *timer)
+{
+	struct uio48_dev *uiodev = container_of(timer, struct uio48_dev, poll_timer);
+
+	// same latch, queue and wake path as a real interrupt
+	irq_handler(0, uiodev);
+
+	hrtimer_forward_now(timer, uiodev->poll_period);
+
+	return HRTIMER_RESTART;
+}
+
+/* Change-of-state sampler for ports 3-5, which have no interrupt hardware */
+static enum hrtimer_restart cos_timer_handler(struct hrtimer *timer)
+{
+	struct uio48_dev *uiodev = container_of(timer, struct uio48_dev, cos_timer);
+	u64 now = ktime_get_ns();
+	unsigned char val, edges;
+	bool active = false, queued = false, changed = false;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	u64 state;
+	int i, j;
+
+	uio48_spnlck_lock(uiodev);
+
+	for (i = 3; i < 6; i++) {
+		// sample ports with enabled bits or watched by a pattern waiter
+		if (uiodev->enab_image[i] == 0 &&
+		    ((uiodev->pattern_mask >> (i * 8)) & 0xff) == 0)
+			continue;
+
+		active = true;
+
+		val = uio_inb(uiodev, uiodev->base_port + i);
+
+		if (val != uiodev->input_image[i])
+			changed = true;
+
+		// enabled bits that changed and now match their polarity
+		edges = (val ^ uiodev->input_image[i]) & ~(val ^ uiodev->pol_image[i]) &
+			uiodev->enab_image[i];
+
+		uiodev->input_image[i] = val;
+
+		for (j = 0; j < 8; j++) {
+			if ((edges >> j) & 1) {
+				queue_event(uiodev, (i * 8) + j + 1, now,
+					    ((val >> j) & 1) ? UIO48_EVENT_RISING : UIO48_EVENT_FALLING);
+				queued = true;
+			}
+		}
+	}
+
+	if (queued)
+		moderate(uiodev);
+
+	if (changed) {
+		state_begin(uiodev);
+		memcpy(&uiodev->state->input_image[3], &uiodev->input_image[3], 3);
+		uiodev->state->input_timestamp = now;
+		state_end(uiodev);
+	}
+
+	if (changed && uiodev->pattern_mask) {
+		state = read_inputs(uiodev, uiodev->pattern_mask & 0xffffff);
+
+		for (i = 3; i < 6; i++)
+			state |= (u64)uiodev->input_image[i] << (i * 8);
+
+		check_patterns(uiodev, state);
+	}
+
+	// Stop sampling once nothing is watched. If enab_cos() re-armed the
+	// timer while we waited for the lock, its expiry must be left alone.
+	if (active && !hrtimer_is_queued(timer)) {
+		hrtimer_forward_now(timer, uiodev->cos_period);
+		ret = HRTIMER_RESTART;
+	}
+
+	uio48_spnlck_unlock(uiodev);
+
+	return ret;
+}
+
+/* End of a one-shot output pulse */
+static enum hrtimer_restart pulse_timer_handler(struct hrtimer *timer)
+{
+	struct uio48_pulse_slot *slot = container_of(timer, struct uio48_pulse_slot, timer);
+	struct uio48_dev *uiodev = slot->uiodev;
+	u64 mask;
+	int i, notify;
+
+	spin_lock(&uiodev->img_lock);
+
+	mask = slot->mask;
+	notify = slot->notify;
+
+	// drive the pulsed bits back to their inactive level
+	for (i = 0; i < 6; i++) {
+		if ((mask >> (i * 8)) & 0xff)
+			update_port(uiodev, i, (mask >> (i * 8)) & 0xff,
+				    slot->polarity ? 0 : 0xff);
+	}
+
+	uiodev->pulse_mask &= ~mask;
+	slot->mask = 0;
+
+	spin_unlock(&uiodev->img_lock);
+
+	// the slot may be reused as soon as the lock is dropped
+	if (notify) {
+		uio48_spnlck_lock(uiodev);
+		queue_event(uiodev, __ffs64(mask) + 1, ktime_get_ns(), UIO48_EVENT_PULSE);
+		moderate(uiodev);
+		uio48_spnlck_unlock(uiodev);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/* Software PWM, one timer for all channels of a device */
+static enum hrtimer_restart pwm_timer_handler(struct hrtimer *timer)
+{
+	struct uio48_dev *uiodev = container_of(timer, struct uio48_dev, pwm_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned char mask[6] = { 0 }, val[6] = { 0 };
+	struct uio48_pwm_chan *chan;
+	u64 now = ktime_get_ns(), period;
+	int i;
+
+	spin_lock(&uiodev->img_lock);
+
+	// set_pwm() re-armed us while we waited for the lock
+	if (hrtimer_is_queued(timer)) {
+		spin_unlock(&uiodev->img_lock);
+		return HRTIMER_NORESTART;
+	}
+
+	for (i = 0; i < 48; i++) {
+		if (!((uiodev->pwm_mask >> i) & 1))
+			continue;
+
+		chan = &uiodev->pwm[i];
+		period = chan->high_ns + chan->low_ns;
+
+		// after a long stall skip whole periods, keeping the phase
+		if (now > chan->next + period)
+			chan->next += div64_u64(now - chan->next, period) * period;
+
+		while (chan->next <= now) {
+			chan->level = !chan->level;
+			chan->next += chan->level ? chan->high_ns : chan->low_ns;
+		}
+
+		mask[i / 8] |= 1 << (i % 8);
+
+		if (chan->level)
+			val[i / 8] |= 1 << (i % 8);
+	}
+
+	// one write per port whose image actually changes
+	for (i = 0; i < 6; i++) {
+		if ((READ_ONCE(uiodev->shadow->port_images[i]) ^ val[i]) & mask[i])
+			update_port(uiodev, i, mask[i], val[i]);
+	}
+
+	if (uiodev->pwm_mask) {
+		hrtimer_set_expires(timer, ns_to_ktime(pwm_next_edge(uiodev)));
+		ret = HRTIMER_RESTART;
+	}
+
+	spin_unlock(&uiodev->img_lock);
+
+	return ret;
+}
+
+/* Interrupt moderation deadline */
+static enum hrtimer_restart mod_timer_handler(struct hrtimer *timer)
+{
+	struct uio48_dev *uiodev = container_of(timer, struct uio48_dev, mod_timer);
+	struct uio48_ring *ring = &uiodev->ring;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+	u64 deadline;
+
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	// moderate() may have re-armed us while we waited for the lock
+	if (ring->inptr != ring->outptr && !hrtimer_is_queued(timer)) {
+		deadline = ring->buf[ring->outptr].timestamp +
+			   (u64)uiodev->mod_usecs * NSEC_PER_USEC;
+
+		// the event we were armed for may already have been consumed
+		if (ktime_get_ns() >= deadline) {
+			notify_events(uiodev);
+		} else {
+			hrtimer_set_expires(timer, ns_to_ktime(deadline));
+			ret = HRTIMER_RESTART;
+		}
+	}
+
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+	return ret;
+}
+
 ///**********************************************************************
 //			DEVICE OPEN
 ///**********************************************************************
@@ -157,16 +733,37 @@ static int device_release(struct inode *inode, struct file *file)
 
 	pr_devel("[%s] device_release\n", uiodev->name);
 
+	fasync_helper(-1, file, 0, &uiodev->async_queue);
+
 	return 0;
 }
 
+///**********************************************************************
+//			DEVICE FASYNC
+// SIGIO is sent whenever readers are woken, see notify_events().
+///**********************************************************************
+static int device_fasync(int fd, struct file *file, int on)
+{
+	struct uio48_dev *uiodev = file->private_data;
+
+	return fasync_helper(fd, file, on, &uiodev->async_queue);
+}
+
 ///**********************************************************************
 //			DEVICE IOCTL
 ///**********************************************************************
-static long device_ioctl(struct file *file, unsigned int ioctl_num,
-			 unsigned long ioctl_param)
+static long __device_ioctl(struct file *file, unsigned int ioctl_num,
+			   unsigned long ioctl_param)
 {
 	struct uio48_dev *uiodev = file->private_data;
+	struct uio48_moderation mod;
+	struct uio48_pattern pat;
+	struct uio48_pulse pulse;
+	struct uio48_pwm pwm;
+	struct uio48_encoder enc;
+	struct uio48_cmd_list list;
+	struct uio48_info info;
+	unsigned long flags;
 	int i, port, ret_val;
 
 	pr_devel("[%s] IOCTL CODE %04X\n", uiodev->name, ioctl_num);
@@ -174,18 +771,25 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 	switch (ioctl_num) {
 	case IOCTL_READ_PORT:
 		port = (ioctl_param & 0xff);
-		ret_val = inb(uiodev->base_port + port);
+		ret_val = uio_inb(uiodev, uiodev->base_port + port);
 		return ret_val;
 
 	case IOCTL_WRITE_PORT:
-		ret_val = mutex_lock_interruptible(&uiodev->mtx);
-
 		port = (ioctl_param >> 8) & 0xff;
 		ret_val = ioctl_param & 0xff;
 
-		outb(ret_val, uiodev->base_port + port);
+		// Output ports go through the image so bit writes stay in step
+		if (port < 6) {
+			update_port(uiodev, port, 0xff, ret_val);
+			return SUCCESS;
+		}
+
+		// other registers depend on the page, keep clear of the ISR
+		uio48_spnlck_lock_irqsave(uiodev, flags);
 
-		mutex_unlock(&uiodev->mtx);
+		uio_outb(uiodev, ioctl_param & 0xff, uiodev->base_port + port);
+
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
 
 		return SUCCESS;
 
@@ -206,14 +810,24 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 		return SUCCESS;
 
 	case IOCTL_ENAB_INT:
+		// the helpers index 6 byte images by the bit number
+		if ((ioctl_param >> 8) < 1 || (ioctl_param >> 8) > 48)
+			return -EINVAL;
+
 		enab_int(uiodev, (int)(ioctl_param >> 8), (int)(ioctl_param & 0xff));
 		return SUCCESS;
 
 	case IOCTL_DISAB_INT:
+		if ((ioctl_param & 0xff) < 1 || (ioctl_param & 0xff) > 48)
+			return -EINVAL;
+
 		disab_int(uiodev, ioctl_param & 0xff);
 		return SUCCESS;
 
 	case IOCTL_CLR_INT:
+		if ((ioctl_param & 0xff) < 1 || (ioctl_param & 0xff) > 48)
+			return -EINVAL;
+
 		clr_int(uiodev, ioctl_param & 0xff);
 		return SUCCESS;
 
@@ -225,8 +839,13 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 		if ((i = get_buffered_int(uiodev)))
             return i;
 
-		uiodev->ready = 0;
-		wait_event(uiodev->wq, uiodev->ready);
+		if (READ_ONCE(uiodev->exclusive))
+			ret_val = wait_exclusive(uiodev);
+		else
+			ret_val = wait_event_interruptible(uiodev->wq, events_due(uiodev));
+
+		if (ret_val)
+			return ret_val;
 
 		/* Getting here does not guarantee that there's an interrupt
 		 * available we may have been awakened by some other signal.
@@ -234,6 +853,8 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 		 * interrupt queue even if it's empty. */
 		i = get_buffered_int(uiodev);
 
+		pass_wakeup(uiodev);
+
 		return i;
 
 	case IOCTL_CLR_INT_ID:
@@ -248,499 +869,2443 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num,
 		unlock_port(uiodev, (int)(ioctl_param & 0xff));
 		return SUCCESS;
 
-	default:
-		return -EINVAL;
-	}
+	case IOCTL_SET_MODERATION:
+		if (copy_from_user(&mod, (void __user *)ioctl_param, sizeof(mod)))
+			return -EFAULT;
 
-	return SUCCESS;
-}
+		// the ring never holds more, a larger count would never be due
+		if (mod.count > MAX_INTS - 1)
+			return -EINVAL;
 
-///**********************************************************************
-//			Module Declarations
-// This structure will hold the functions to be called
-// when a process does something to the device
-///**********************************************************************
-static struct file_operations uio48_fops = {
-	owner:			THIS_MODULE,
-	unlocked_ioctl:		device_ioctl,
-	open:			device_open,
-	release:		device_release,
-};
+		uio48_spnlck_lock_irqsave(uiodev, flags);
 
-///**********************************************************************
-//			INIT MODULE
-///**********************************************************************
-// register the character device
-int init_module()
-{
-	int ret_val, io_num;
-	dev_t dev;
-	int x;
+		uiodev->mod_count = mod.count ? mod.count : 1;
+		uiodev->mod_usecs = mod.usecs;
 
-	pr_info(MOD_DESC " loading\n");
+		// apply the new thresholds to whatever is already queued
+		moderate(uiodev);
 
-	uio48_class = class_create(KBUILD_MODNAME);
-	if (IS_ERR(uio48_class)) {
-		pr_err("Could not create module class\n");
-		return PTR_ERR(uio48_class);
-	}
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
 
-	/* Register the character device. */
-	if (uio48_init_major) {
-		uio48_devno = MKDEV(uio48_init_major, 0);
-		ret_val = register_chrdev_region(uio48_devno, MAX_CHIPS, KBUILD_MODNAME);
-	} else {
-		ret_val = alloc_chrdev_region(&uio48_devno, 0, MAX_CHIPS, KBUILD_MODNAME);
-		uio48_init_major = MAJOR(uio48_devno);
-	}
+		return SUCCESS;
 
-	if (ret_val < 0) {
-		pr_err("Cannot obtain major number (%d)\n", uio48_init_major);
-		return ret_val;
-	}
+	case IOCTL_WAIT_PATTERN:
+		if (copy_from_user(&pat, (void __user *)ioctl_param, sizeof(pat)))
+			return -EFAULT;
 
-	pr_info("Major number %d assigned\n", uio48_init_major);
+		return wait_pattern(uiodev, pat.mask, pat.value, pat.timeout_ms);
 
-	for (x = io_num = 0; x < MAX_CHIPS; x++) {
-		struct uio48_dev *uiodev = &uiodevs[x];
+	case IOCTL_PULSE:
+		if (copy_from_user(&pulse, (void __user *)ioctl_param, sizeof(pulse)))
+			return -EFAULT;
 
-		/* If no IO port, skip this idx. */
-		if (io[x] == 0)
-			continue;
+		return start_pulse(uiodev, &pulse);
 
-		mutex_init(&uiodev->mtx);
-		spin_lock_init(&uiodev->spnlck);
-		init_waitqueue_head(&uiodev->wq);
+	case IOCTL_SET_PWM:
+		if (copy_from_user(&pwm, (void __user *)ioctl_param, sizeof(pwm)))
+			return -EFAULT;
 
-		dev = uio48_devno + x;
+		return set_pwm(uiodev, &pwm);
 
-		/* Initialize char device. */
-		cdev_init(&uiodev->cdev, &uio48_fops);
-		ret_val = cdev_add(&uiodev->cdev, dev, 1);
+	case IOCTL_SET_ENCODER:
+		if (copy_from_user(&enc, (void __user *)ioctl_param, sizeof(enc)))
+			return -EFAULT;
 
-		if (ret_val) {
-			pr_err("Error adding character device for node %d\n", x);
+		return set_encoder(uiodev, &enc);
+
+	case IOCTL_GET_ENCODER:
+		if (copy_from_user(&enc, (void __user *)ioctl_param, sizeof(enc)))
+			return -EFAULT;
+
+		ret_val = get_encoder(uiodev, &enc);
+		if (ret_val)
 			return ret_val;
-		}
 
-		/* Check and map our I/O region requests. */
-		if (request_region(io[x], 0x10, KBUILD_MODNAME) == NULL) {
-			pr_err("Unable to use I/O Address %04X\n", io[x]);
-			cdev_del(&uiodev->cdev);
-			continue;
+		if (copy_to_user((void __user *)ioctl_param, &enc, sizeof(enc)))
+			return -EFAULT;
+
+		return SUCCESS;
+
+	case IOCTL_CMD_LIST:
+		if (copy_from_user(&list, (void __user *)ioctl_param, sizeof(list)))
+			return -EFAULT;
+
+		return run_cmd_list(uiodev, &list);
+
+	case IOCTL_SET_EVENTFD:
+		return set_eventfd(uiodev, (int)ioctl_param);
+
+	case IOCTL_SET_WAIT_MODE:
+		if (ioctl_param != UIO48_WAIT_SHARED && ioctl_param != UIO48_WAIT_EXCLUSIVE)
+			return -EINVAL;
+
+		WRITE_ONCE(uiodev->exclusive, ioctl_param == UIO48_WAIT_EXCLUSIVE);
+
+		// exclusive sleepers from before a switch to shared mode
+		wake_up_all(&uiodev->wq);
+
+		return SUCCESS;
+
+	case IOCTL_GET_INFO:
+		memset(&info, 0, sizeof(info));
+		// a fake device has no ports user space could touch
+		info.base_port = uiodev->fake ? 0 : uiodev->base_port;
+		info.irq = uiodev->irq;
+		info.ports = 6;
+
+		if (copy_to_user((void __user *)ioctl_param, &info, sizeof(info)))
+			return -EFAULT;
+
+		return SUCCESS;
+
+	case IOCTL_GET_MODERATION:
+		uio48_spnlck_lock_irqsave(uiodev, flags);
+		mod.count = uiodev->mod_count;
+		mod.usecs = uiodev->mod_usecs;
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+		if (copy_to_user((void __user *)ioctl_param, &mod, sizeof(mod)))
+			return -EFAULT;
+
+		return SUCCESS;
+
+	default:
+		return -EINVAL;
+	}
+
+	return SUCCESS;
+}
+
+// Times every ioctl for the uio48_ioctl tracepoint
+static long device_ioctl(struct file *file, unsigned int ioctl_num,
+			 unsigned long ioctl_param)
+{
+	struct uio48_dev *uiodev = file->private_data;
+	u64 start = 0;
+	long ret;
+
+	if (trace_uio48_ioctl_enabled())
+		start = ktime_get_ns();
+
+	ret = __device_ioctl(file, ioctl_num, ioctl_param);
+
+	if (trace_uio48_ioctl_enabled())
+		trace_uio48_ioctl(uiodev->chip, ioctl_num, ret,
+				  start ? ktime_get_ns() - start : 0);
+
+	return ret;
+}
+
+///**********************************************************************
+//			DEVICE READ
+// Returns as many whole struct uio48_event records as fit in the buffer.
+// Blocking readers sleep until the moderation thresholds are met.
+///**********************************************************************
+static ssize_t device_read(struct file *file, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	struct uio48_dev *uiodev = file->private_data;
+	struct uio48_event evs[16];
+	size_t done = 0;
+	int n, ret_val;
+
+	if (count < sizeof(struct uio48_event))
+		return -EINVAL;
+
+	while (!done) {
+		if (!(file->f_flags & O_NONBLOCK)) {
+			if (READ_ONCE(uiodev->exclusive))
+				ret_val = wait_exclusive(uiodev);
+			else
+				ret_val = wait_event_interruptible(uiodev->wq, events_due(uiodev));
+
+			if (ret_val)
+				return ret_val;
 		}
 
-		init_io(uiodev, io[x]);
+		while (count - done >= sizeof(struct uio48_event)) {
+			n = min_t(size_t, ARRAY_SIZE(evs),
+				  (count - done) / sizeof(struct uio48_event));
 
-		/* Check and map any interrupts. */
-		if (irq[x]) {
-			if (request_irq(irq[x], irq_handler, IRQF_SHARED, KBUILD_MODNAME, uiodev)) {
-				pr_err("Unable to register IRQ %d\n", irq[x]);
-				release_region(io[x], 0x10);
-				cdev_del(&uiodev->cdev);
-				continue;
-			}
+			n = get_events(uiodev, evs, n);
+			if (n == 0)
+				break;
 
-			uiodev->irq = irq[x];
+			if (copy_to_user(buf + done, evs, n * sizeof(struct uio48_event)))
+				return -EFAULT;
+
+			done += n * sizeof(struct uio48_event);
 		}
 
-		io_num++;
+		if (!done && (file->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+	}
+
+	pass_wakeup(uiodev);
+
+	return done;
+}
+
+///**********************************************************************
+//			DEVICE POLL
+///**********************************************************************
+static __poll_t device_poll(struct file *file, poll_table *wait)
+{
+	struct uio48_dev *uiodev = file->private_data;
+
+	poll_wait(file, &uiodev->wq, wait);
+
+	if (events_due(uiodev))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+///**********************************************************************
+//			DEVICE URING_CMD
+// UIO48_URING_CMD runs one port or bit command inline. UIO48_URING_WAIT
+// completes with the due events, from task work once notify_events()
+// runs if none are due yet.
+///**********************************************************************
+#ifdef UIO48_HAVE_URING
+
+// The command area of the SQE
+static const void *uring_arg(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	return ioucmd->cmd;
+#endif
+}
+
+#ifdef UIO48_HAVE_URING_CANCEL
+
+// Per request state, kept in the pdu of the command
+struct uio48_uring_pdu {
+	struct list_head list;		// on uring_waits while pending
+	u64 events;			// user buffer
+	u32 max_events;
+};
+
+static struct uio48_uring_pdu *uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct uio48_uring_pdu) > sizeof(ioucmd->pdu));
+
+	return (struct uio48_uring_pdu *)ioucmd->pdu;
+}
+
+// Copy events into the buffer of a wait. Returns the number copied.
+static int uring_copy_events(struct uio48_dev *uiodev, struct uio48_uring_pdu *pdu)
+{
+	struct uio48_event __user *ubuf = u64_to_user_ptr(pdu->events);
+	struct uio48_event evs[16];
+	int n, done = 0;
+
+	while (done < pdu->max_events) {
+		n = get_events(uiodev, evs, min_t(u32, ARRAY_SIZE(evs),
+						  pdu->max_events - done));
+		if (n == 0)
+			break;
+
+		if (copy_to_user(ubuf + done, evs, n * sizeof(struct uio48_event)))
+			return -EFAULT;
+
+		done += n;
+	}
+
+	return done;
+}
+
+// Take the due events for a wait, or queue it for uring_notify().
+// Returns the number of events, -EIOCBQUEUED if queued, or an error.
+static int uring_wait(struct uio48_dev *uiodev, struct io_uring_cmd *ioucmd)
+{
+	struct uio48_uring_pdu *pdu = uring_pdu(ioucmd);
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		uio48_spnlck_lock_irqsave(uiodev, flags);
+
+		if (!__events_due(uiodev)) {
+			list_add_tail(&pdu->list, &uiodev->uring_waits);
+			uio48_spnlck_unlock_irqrestore(uiodev, flags);
+			return -EIOCBQUEUED;
+		}
+
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+		// 0 means another reader took them first
+		ret = uring_copy_events(uiodev, pdu);
+		if (ret)
+			return ret;
+	}
+}
+
+static void uring_wait_task(struct io_uring_cmd *ioucmd, unsigned issue_flags)
+{
+	int ret;
+
+	ret = uring_wait(ioucmd->file->private_data, ioucmd);
+	if (ret != -EIOCBQUEUED)
+		io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+}
+
+static int uring_cancel(struct uio48_dev *uiodev, struct io_uring_cmd *ioucmd,
+			unsigned issue_flags)
+{
+	struct uio48_uring_pdu *pdu = uring_pdu(ioucmd);
+	unsigned long flags;
+	bool pending;
+
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	// off the list means uring_notify() already owns it
+	pending = !list_empty(&pdu->list);
+	if (pending)
+		list_del_init(&pdu->list);
+
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+	if (pending)
+		io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+
+	return 0;
+}
+
+// Hand the pending waits to task work, which copies the events in the
+// submitter's context. Called with spnlck held.
+static void uring_notify(struct uio48_dev *uiodev)
+{
+	struct uio48_uring_pdu *pdu, *tmp;
+
+	list_for_each_entry_safe(pdu, tmp, &uiodev->uring_waits, list) {
+		list_del_init(&pdu->list);
+		io_uring_cmd_complete_in_task(container_of((void *)pdu, struct io_uring_cmd, pdu),
+					      uring_wait_task);
+	}
+}
+
+#endif /* UIO48_HAVE_URING_CANCEL */
+
+static int device_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct uio48_dev *uiodev = ioucmd->file->private_data;
+	struct uio48_cmd cmd;
+#ifdef UIO48_HAVE_URING_CANCEL
+	const struct uio48_uring_wait *wait;
+	struct uio48_uring_pdu *pdu = uring_pdu(ioucmd);
+	int ret;
+
+	if (issue_flags & IO_URING_F_CANCEL)
+		return uring_cancel(uiodev, ioucmd, issue_flags);
+#endif
+
+	switch (ioucmd->cmd_op) {
+	case UIO48_URING_CMD:
+		memcpy(&cmd, uring_arg(ioucmd), sizeof(cmd));
+
+		// a delay would stall the submitter, link a ring timeout instead
+		if (cmd.op == UIO48_OP_DELAY)
+			return -EINVAL;
+
+		return run_cmd(uiodev, &cmd);
+
+	case UIO48_URING_WAIT:
+#ifdef UIO48_HAVE_URING_CANCEL
+		wait = uring_arg(ioucmd);
+		pdu->events = READ_ONCE(wait->events);
+		pdu->max_events = READ_ONCE(wait->max_events);
+		INIT_LIST_HEAD(&pdu->list);
+
+		if (pdu->max_events == 0)
+			return -EINVAL;
+
+		// A cancelable command is only ever completed by io_uring_cmd_done()
+		io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+
+		ret = uring_wait(uiodev, ioucmd);
+		if (ret != -EIOCBQUEUED)
+			io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+
+		return -EIOCBQUEUED;
+#else
+		return -EOPNOTSUPP;
+#endif
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+#endif /* UIO48_HAVE_URING */
+
+#ifndef UIO48_HAVE_URING_CANCEL
+static void uring_notify(struct uio48_dev *uiodev)
+{
+}
+#endif
+
+///**********************************************************************
+//			DEVICE MMAP
+// Maps the read-only struct uio48_state page of the device.
+///**********************************************************************
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct uio48_dev *uiodev = file->private_data;
+	void *page;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+
+	if (vma->vm_pgoff == 0) {
+		// the read-only state page
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+
+		vm_flags_clear(vma, VM_MAYWRITE);
+		page = uiodev->state;
+	} else if (vma->vm_pgoff == 1) {
+		// the writable output images, only useful together with ioperm()
+		if (!capable(CAP_SYS_RAWIO))
+			return -EPERM;
+
+		page = uiodev->shadow;
+	} else {
+		return -EINVAL;
+	}
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(page) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
+}
+
+///**********************************************************************
+//			Module Declarations
+// This structure will hold the functions to be called
+// when a process does something to the device
+///**********************************************************************
+static struct file_operations uio48_fops = {
+	owner:			THIS_MODULE,
+	read:			device_read,
+	poll:			device_poll,
+	mmap:			device_mmap,
+	unlocked_ioctl:		device_ioctl,
+	open:			device_open,
+	release:		device_release,
+	fasync:			device_fasync,
+#ifdef UIO48_HAVE_URING
+	uring_cmd:		device_uring_cmd,
+#endif
+};
+
+///**********************************************************************
+//			AGGREGATE NODE
+// read() and poll() as on a chip node, over the events of all chips
+// queued while the node is open. Every record carries its chip index and
+// latch timestamp. Sleeping readers are woken along with each chip's
+// moderated wakeup, but a read or poll returns whatever is queued,
+// moderation only applies to the chip nodes.
+///**********************************************************************
+
+// Copy an event into the aggregate ring, dropping the oldest one when it
+// is full. Called with the chip's spnlck held.
+static void agg_queue(const struct uio48_event *ev)
+{
+	struct uio48_ring *ring = &agg.ring;
+
+	// keep the ISR off the global lock while nobody listens
+	if (!atomic_read(&agg.readers))
+		return;
+
+	spin_lock(&agg.lock);
+
+	ring->buf[ring->inptr] = *ev;
+	ring->inptr = (ring->inptr + 1) & (MAX_INTS - 1);
+
+	if (ring->inptr == ring->outptr) {
+		ring->outptr = (ring->outptr + 1) & (MAX_INTS - 1);
+		agg.overruns++;
+	}
+
+	spin_unlock(&agg.lock);
+}
+
+static int agg_get_events(struct uio48_event *evs, int max)
+{
+	struct uio48_ring *ring = &agg.ring;
+	unsigned long flags;
+	int n = 0;
+
+	spin_lock_irqsave(&agg.lock, flags);
+
+	while (n < max && ring->outptr != ring->inptr) {
+		evs[n++] = ring->buf[ring->outptr];
+		ring->outptr = (ring->outptr + 1) & (MAX_INTS - 1);
+	}
+
+	spin_unlock_irqrestore(&agg.lock, flags);
+
+	return n;
+}
+
+static bool agg_due(void)
+{
+	return READ_ONCE(agg.ring.inptr) != READ_ONCE(agg.ring.outptr);
+}
+
+static int agg_open(struct inode *inode, struct file *file)
+{
+	atomic_inc(&agg.readers);
+
+	return 0;
+}
+
+static int agg_release(struct inode *inode, struct file *file)
+{
+	unsigned long flags;
+
+	// the last reader leaves, later ones start from an empty ring
+	if (atomic_dec_and_test(&agg.readers)) {
+		spin_lock_irqsave(&agg.lock, flags);
+		agg.ring.outptr = agg.ring.inptr;
+		spin_unlock_irqrestore(&agg.lock, flags);
+	}
+
+	return 0;
+}
+
+static ssize_t agg_read(struct file *file, char __user *buf, size_t count,
+			loff_t *ppos)
+{
+	struct uio48_event evs[16];
+	size_t done = 0;
+	int n, ret_val;
+
+	if (count < sizeof(struct uio48_event))
+		return -EINVAL;
+
+	while (!done) {
+		if (!(file->f_flags & O_NONBLOCK)) {
+			ret_val = wait_event_interruptible(agg.wq, agg_due());
+			if (ret_val)
+				return ret_val;
+		}
+
+		while (count - done >= sizeof(struct uio48_event)) {
+			n = min_t(size_t, ARRAY_SIZE(evs),
+				  (count - done) / sizeof(struct uio48_event));
+
+			n = agg_get_events(evs, n);
+			if (n == 0)
+				break;
+
+			if (copy_to_user(buf + done, evs, n * sizeof(struct uio48_event)))
+				return -EFAULT;
+
+			done += n * sizeof(struct uio48_event);
+		}
+
+		if (!done && (file->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+	}
+
+	return done;
+}
+
+static __poll_t agg_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &agg.wq, wait);
+
+	if (agg_due())
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static struct file_operations uio48_agg_fops = {
+	owner:			THIS_MODULE,
+	read:			agg_read,
+	poll:			agg_poll,
+	open:			agg_open,
+	release:		agg_release,
+};
+
+///**********************************************************************
+//			FAKE DEVICE
+// A register file in memory behind the same io ops, so the ISR, the
+// paging sequences and the ring can be exercised and timed without a
+// card. Fake devices always run from the poll timer. Inputs are driven
+// and benchmarks started through debugfs.
+///**********************************************************************
+
+// Level the fake chip reads back from a port. Called with f->lock held.
+static u8 fake_pins(struct uio48_fake *f, int port)
+{
+	return f->latch[port] | f->input[port];
+}
+
+// Latch interrupt IDs for edges on ports 0-2. Called with f->lock held.
+static void fake_edges(struct uio48_fake *f, int port, u8 old)
+{
+	u8 now = fake_pins(f, port);
+	u8 rise = now & ~old;
+	u8 fall = old & ~now;
+
+	if (port < 3)
+		f->int_id[port] |= ((rise & f->pol[port]) | (fall & ~f->pol[port])) &
+				   f->enab[port];
+}
+
+static u8 fake_inb(struct uio48_dev *uiodev, unsigned port)
+{
+	struct uio48_fake *f = uiodev->fake;
+	unsigned reg = port - uiodev->base_port;
+	unsigned long flags;
+	u8 val = 0;
+
+	spin_lock_irqsave(&f->lock, flags);
+
+	if (reg < 6) {
+		val = fake_pins(f, reg);
+	} else if (reg == 6) {
+		val = (f->int_id[0] ? 1 : 0) | (f->int_id[1] ? 2 : 0) | (f->int_id[2] ? 4 : 0);
+	} else if (reg == 7) {
+		val = f->page_lock;
+	} else if (reg <= 0x0a) {
+		switch (f->page_lock & 0xc0) {
+		case PAGE1:
+			val = f->pol[reg - 8];
+			break;
+		case PAGE2:
+			val = f->enab[reg - 8];
+			break;
+		case PAGE3:
+			val = f->int_id[reg - 8];
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&f->lock, flags);
+
+	return val;
+}
+
+static void fake_outb(struct uio48_dev *uiodev, u8 val, unsigned port)
+{
+	struct uio48_fake *f = uiodev->fake;
+	unsigned reg = port - uiodev->base_port;
+	unsigned long flags;
+	u8 old;
+
+	spin_lock_irqsave(&f->lock, flags);
+
+	if (reg < 6) {
+		// locked ports ignore writes
+		if (!((f->page_lock >> reg) & 1)) {
+			old = fake_pins(f, reg);
+			f->latch[reg] = val;
+			fake_edges(f, reg, old);
+		}
+	} else if (reg == 7) {
+		f->page_lock = val;
+	} else if (reg >= 8 && reg <= 0x0a) {
+		switch (f->page_lock & 0xc0) {
+		case PAGE1:
+			f->pol[reg - 8] = val;
+			break;
+		case PAGE2:
+			// disabling a bit also drops its latched interrupt
+			f->enab[reg - 8] = val;
+			f->int_id[reg - 8] &= val;
+			break;
+		case PAGE3:
+			// writing a 0 clears the interrupt ID bit
+			f->int_id[reg - 8] &= val;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&f->lock, flags);
+}
+
+static const struct uio48_io_ops fake_io_ops = {
+	.inb = fake_inb,
+	.outb = fake_outb,
+};
+
+// Drive the input pins selected by mask to the levels in value
+static void fake_drive(struct uio48_fake *f, u64 mask, u64 value)
+{
+	unsigned long flags;
+	int port;
+	u8 m, old;
+
+	spin_lock_irqsave(&f->lock, flags);
+
+	for (port = 0; port < 6; port++) {
+		m = mask >> (port * 8);
+		if (m == 0)
+			continue;
+
+		old = fake_pins(f, port);
+		f->input[port] = (f->input[port] & ~m) | ((value >> (port * 8)) & m);
+		fake_edges(f, port, old);
+	}
+
+	spin_unlock_irqrestore(&f->lock, flags);
+}
+
+// "<mask> <value>" in hex drives the selected input bits
+static ssize_t inject_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct uio48_dev *uiodev = file->private_data;
+	char kbuf[64];
+	u64 mask, value;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+
+	kbuf[count] = 0;
+
+	if (sscanf(kbuf, "%llx %llx", &mask, &value) != 2)
+		return -EINVAL;
+
+	fake_drive(uiodev->fake, mask, value);
+
+	return count;
+}
+
+static const struct file_operations inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = inject_write,
+};
+
+// Cost of the interrupt handler for one latched event
+static void bench_isr(struct uio48_dev *uiodev, unsigned n)
+{
+	struct uio48_fake *f = uiodev->fake;
+	struct uio48_event ev;
+	unsigned long flags;
+	u64 start, ns = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		spin_lock_irqsave(&f->lock, flags);
+		f->int_id[0] |= 1;
+		spin_unlock_irqrestore(&f->lock, flags);
+
+		local_irq_save(flags);
+		start = ktime_get_ns();
+		irq_handler(0, uiodev);
+		ns += ktime_get_ns() - start;
+		local_irq_restore(flags);
+
+		get_events(uiodev, &ev, 1);
+	}
+
+	snprintf(uiodev->bench_result, sizeof(uiodev->bench_result),
+		 "isr %u events %llu ns/event\n", n, div_u64(ns, n));
+}
+
+// Queue and drain bursts twice the ring size, so every burst wraps and
+// overruns
+static void bench_ring(struct uio48_dev *uiodev, unsigned n)
+{
+	struct uio48_event evs[64];
+	unsigned overruns = uiodev->overruns;
+	unsigned long flags;
+	u64 start, q_ns = 0, d_ns = 0, now = ktime_get_ns();
+	unsigned i, j, burst;
+
+	for (i = 0; i < n; i += burst) {
+		burst = min(n - i, 2U * MAX_INTS);
+
+		uio48_spnlck_lock_irqsave(uiodev, flags);
+		start = ktime_get_ns();
+		for (j = 0; j < burst; j++)
+			queue_event(uiodev, 1, now, UIO48_EVENT_RISING);
+		q_ns += ktime_get_ns() - start;
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+		start = ktime_get_ns();
+		while (get_events(uiodev, evs, ARRAY_SIZE(evs)))
+			;
+		d_ns += ktime_get_ns() - start;
+	}
+
+	snprintf(uiodev->bench_result, sizeof(uiodev->bench_result),
+		 "ring %u events %llu ns/queue %llu ns/dequeue %u overruns\n", n,
+		 div_u64(q_ns, n), div_u64(d_ns, n), uiodev->overruns - overruns);
+}
+
+// Cost of the bit write and read paths behind the ioctls
+static void bench_io(struct uio48_dev *uiodev, unsigned n)
+{
+	u64 start, ns;
+	unsigned i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < n; i++) {
+		write_bit(uiodev, 1, i & 1);
+		read_bit(uiodev, 1);
+	}
+	ns = ktime_get_ns() - start;
+
+	snprintf(uiodev->bench_result, sizeof(uiodev->bench_result),
+		 "io %u writes+reads %llu ns/op\n", n, div_u64(ns, 2 * n));
+}
+
+#define MAX_BENCH	10000000
+
+// "isr|ring|io <count>" runs a benchmark, reading returns the result
+static ssize_t bench_write(struct file *file, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct uio48_dev *uiodev = file->private_data;
+	char kbuf[32], name[8];
+	unsigned n;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+
+	kbuf[count] = 0;
+
+	if (sscanf(kbuf, "%7s %u", name, &n) != 2 || n == 0 || n > MAX_BENCH)
+		return -EINVAL;
+
+	if (strcmp(name, "isr") && strcmp(name, "ring") && strcmp(name, "io"))
+		return -EINVAL;
+
+	if (uio48_mtx_lock(uiodev))
+		return -ERESTARTSYS;
+
+	// keep the poll timer from servicing our events
+	hrtimer_cancel(&uiodev->poll_timer);
+
+	if (!strcmp(name, "isr"))
+		bench_isr(uiodev, n);
+	else if (!strcmp(name, "ring"))
+		bench_ring(uiodev, n);
+	else
+		bench_io(uiodev, n);
+
+	hrtimer_start(&uiodev->poll_timer, uiodev->poll_period, HRTIMER_MODE_REL);
+
+	uio48_mtx_unlock(uiodev);
+
+	return count;
+}
+
+static ssize_t bench_read(struct file *file, char __user *buf, size_t count,
+			  loff_t *ppos)
+{
+	struct uio48_dev *uiodev = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, uiodev->bench_result,
+				       strlen(uiodev->bench_result));
+}
+
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = bench_read,
+	.write = bench_write,
+	.llseek = default_llseek,
+};
+
+///**********************************************************************
+//			LATENCY HISTOGRAMS
+// Updated without locks from the ISR and the readers. Reading the debugfs
+// file prints the non-empty buckets, writing anything to it resets them.
+///**********************************************************************
+static void hist_add(struct uio48_hist *hist, u64 ns)
+{
+	int i = ns ? fls64(ns) - 1 : 0;
+
+	atomic_long_inc(&hist->buckets[min(i, HIST_BUCKETS - 1)]);
+}
+
+static int hist_show(struct seq_file *m, void *v)
+{
+	struct uio48_hist *hist = m->private;
+	unsigned long count, total = 0;
+	int i;
+
+	seq_puts(m, "# ns_low ns_high count\n");
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		count = atomic_long_read(&hist->buckets[i]);
+		total += count;
+
+		if (count)
+			seq_printf(m, "%llu %llu %lu\n", i ? 1ULL << i : 0,
+				   (2ULL << i) - 1, count);
+	}
+
+	seq_printf(m, "# total %lu\n", total);
+
+	return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hist_show, inode->i_private);
+}
+
+static ssize_t hist_write(struct file *file, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	struct uio48_hist *hist = ((struct seq_file *)file->private_data)->private;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		atomic_long_set(&hist->buckets[i], 0);
+
+	return count;
+}
+
+static const struct file_operations hist_fops = {
+	.owner = THIS_MODULE,
+	.open = hist_open,
+	.read = seq_read,
+	.write = hist_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void uio48_debugfs_init(struct uio48_dev *uiodev)
+{
+	uiodev->dbg = debugfs_create_dir(uiodev->name, uio48_debugfs);
+	debugfs_create_file("isr_latency", 0600, uiodev->dbg, &uiodev->isr_hist,
+			    &hist_fops);
+	debugfs_create_file("event_latency", 0600, uiodev->dbg, &uiodev->event_hist,
+			    &hist_fops);
+	debugfs_create_file("port_lock_hold", 0600, uiodev->dbg, &uiodev->port_hold_hist,
+			    &hist_fops);
+	debugfs_create_file("page_lock_hold", 0600, uiodev->dbg, &uiodev->page_hold_hist,
+			    &hist_fops);
+
+	if (!uiodev->fake)
+		return;
+
+	debugfs_create_file("inject", 0200, uiodev->dbg, uiodev, &inject_fops);
+	debugfs_create_file("bench", 0600, uiodev->dbg, uiodev, &bench_fops);
+}
+
+///**********************************************************************
+//			INIT MODULE
+///**********************************************************************
+// register the character device
+int init_module()
+{
+	int ret_val, io_num;
+	unsigned base;
+	dev_t dev;
+	int x;
+
+	pr_info(MOD_DESC " loading\n");
+
+	BUILD_BUG_ON(sizeof(struct uio48_state) > PAGE_SIZE);
+
+	uio48_class = class_create(KBUILD_MODNAME);
+	if (IS_ERR(uio48_class)) {
+		pr_err("Could not create module class\n");
+		return PTR_ERR(uio48_class);
+	}
+
+	/* Register the character device. */
+	if (uio48_init_major) {
+		uio48_devno = MKDEV(uio48_init_major, 0);
+		ret_val = register_chrdev_region(uio48_devno, MAX_CHIPS + 1, KBUILD_MODNAME);
+	} else {
+		ret_val = alloc_chrdev_region(&uio48_devno, 0, MAX_CHIPS + 1, KBUILD_MODNAME);
+		uio48_init_major = MAJOR(uio48_devno);
+	}
+
+	if (ret_val < 0) {
+		pr_err("Cannot obtain major number (%d)\n", uio48_init_major);
+		return ret_val;
+	}
+
+	pr_info("Major number %d assigned\n", uio48_init_major);
+
+	uio48_debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	for (x = io_num = 0; x < MAX_CHIPS; x++) {
+		struct uio48_dev *uiodev = &uiodevs[x];
+
+		/* If no IO port, skip this idx. */
+		if (io[x] == 0 && !fake[x])
+			continue;
+
+		init_dev(uiodev, x);
+
+		/* Check and map our I/O region requests before anything is allocated. */
+		if (!fake[x] && request_region(io[x], 0x10, KBUILD_MODNAME) == NULL) {
+			pr_err("Unable to use I/O Address %04X\n", io[x]);
+			continue;
+		}
+
+		if (alloc_dev(uiodev, fake[x])) {
+			pr_err("Unable to allocate pages for node %d\n", x);
+			if (!fake[x])
+				release_region(io[x], 0x10);
+			continue;
+		}
+
+		uiodev->io = &hw_io_ops;
+		base = io[x];
+
+		if (uiodev->fake) {
+			uiodev->io = &fake_io_ops;
+			base = FAKE_BASE + x * 0x10;
+		}
+
+		uiodev->cos_period = us_to_ktime(cos_us[x] ? cos_us[x] : DEFAULT_COS_US);
+
+		dev = uio48_devno + x;
+
+		/* Initialize char device. */
+		cdev_init(&uiodev->cdev, &uio48_fops);
+		ret_val = cdev_add(&uiodev->cdev, dev, 1);
+
+		if (ret_val) {
+			pr_err("Error adding character device for node %d\n", x);
+			if (!uiodev->fake)
+				release_region(io[x], 0x10);
+			free_dev(uiodev);
+			continue;
+		}
+
+		init_io(uiodev, base);
+
+		/* Check and map any interrupts. A fake device has none. */
+		if (irq[x] && !uiodev->fake) {
+			if (request_irq(irq[x], irq_handler, IRQF_SHARED, KBUILD_MODNAME, uiodev)) {
+				pr_err("Unable to register IRQ %d\n", irq[x]);
+				cdev_del(&uiodev->cdev);
+				release_region(io[x], 0x10);
+				uiodev->base_port = 0;
+				free_dev(uiodev);
+				continue;
+			}
+
+			uiodev->irq = irq[x];
+		} else {
+			/* No IRQ, so sample the pending registers from a timer. */
+			uiodev->poll_period = us_to_ktime(poll_us[x] ? poll_us[x] : DEFAULT_POLL_US);
+			hrtimer_init(&uiodev->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+			uiodev->poll_timer.function = poll_timer_handler;
+			hrtimer_start(&uiodev->poll_timer, uiodev->poll_period, HRTIMER_MODE_REL);
+		}
+
+		io_num++;
+
+		sprintf(uiodev->name, KBUILD_MODNAME "%c", 'a' + x);
+
+		pr_info("[%s] Added new device\n", uiodev->name);
+
+		device_create(uio48_class, NULL, dev, NULL, "%s", uiodev->name);
+
+		uio48_debugfs_init(uiodev);
+	}
+
+	if (io_num) {
+		cdev_init(&agg.cdev, &uio48_agg_fops);
+
+		if (cdev_add(&agg.cdev, uio48_devno + MAX_CHIPS, 1)) {
+			pr_err("Error adding the aggregate device, continuing without it\n");
+			return 0;
+		}
+
+		device_create(uio48_class, NULL, uio48_devno + MAX_CHIPS, NULL,
+			      KBUILD_MODNAME "all");
+		agg.registered = 1;
+
+		return 0;
+	}
+
+	pr_warn("No resources available, driver terminating\n");
+
+	debugfs_remove_recursive(uio48_debugfs);
+
+	class_destroy(uio48_class);
+	unregister_chrdev_region(uio48_devno, MAX_CHIPS + 1);
+
+	return -ENODEV;
+}
+
+// Locks, wait queues and timers of a device, before its registers are
+// touched. The caller allocates the state pages and picks the io ops.
+static void init_dev(struct uio48_dev *uiodev, int chip)
+{
+	int i;
+
+	mutex_init(&uiodev->mtx);
+	spin_lock_init(&uiodev->spnlck);
+	spin_lock_init(&uiodev->img_lock);
+
+	for (i = 0; i < 6; i++)
+		spin_lock_init(&uiodev->port_lock[i]);
+
+	spin_lock_init(&uiodev->state_lock);
+
+	init_waitqueue_head(&uiodev->wq);
+	INIT_LIST_HEAD(&uiodev->pattern_waiters);
+	INIT_LIST_HEAD(&uiodev->uring_waits);
+
+	uiodev->chip = chip;
+	uiodev->mod_count = 1;
+	hrtimer_init(&uiodev->mod_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	uiodev->mod_timer.function = mod_timer_handler;
+	uiodev->cos_period = us_to_ktime(DEFAULT_COS_US);
+	hrtimer_init(&uiodev->cos_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	uiodev->cos_timer.function = cos_timer_handler;
+
+	hrtimer_init(&uiodev->pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	uiodev->pwm_timer.function = pwm_timer_handler;
+
+	for (i = 0; i < MAX_PULSES; i++) {
+		hrtimer_init(&uiodev->pulses[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		uiodev->pulses[i].timer.function = pulse_timer_handler;
+		uiodev->pulses[i].uiodev = uiodev;
+	}
+}
+
+// The state and shadow pages, and the registers of a fake device.
+// Nothing is left allocated on failure.
+static int alloc_dev(struct uio48_dev *uiodev, int fake)
+{
+	uiodev->state = (struct uio48_state *)get_zeroed_page(GFP_KERNEL);
+	uiodev->shadow = (struct uio48_shadow *)get_zeroed_page(GFP_KERNEL);
+
+	if (fake)
+		uiodev->fake = kzalloc(sizeof(*uiodev->fake), GFP_KERNEL);
+
+	if (uiodev->state == NULL || uiodev->shadow == NULL || (fake && uiodev->fake == NULL)) {
+		free_dev(uiodev);
+		return -ENOMEM;
+	}
+
+	if (uiodev->fake) {
+		spin_lock_init(&uiodev->fake->lock);
+		uiodev->fake->page_lock = PAGE3;
+	}
+
+	return 0;
+}
+
+// Undo alloc_dev. A NULL state marks the node unused for cleanup_module.
+static void free_dev(struct uio48_dev *uiodev)
+{
+	free_page((unsigned long)uiodev->state);
+	free_page((unsigned long)uiodev->shadow);
+	kfree(uiodev->fake);
+
+	uiodev->state = NULL;
+	uiodev->shadow = NULL;
+	uiodev->fake = NULL;
+}
+
+///**********************************************************************
+//			CLEANUP MODULE
+///**********************************************************************
+// unregister the appropriate file from /proc
+void cleanup_module()
+{
+	int x, i;
+
+	debugfs_remove_recursive(uio48_debugfs);
+
+	/* Unregister I/O port usage and IRQ */
+	for (x = 0; x < MAX_CHIPS; x++) {
+		struct uio48_dev *uiodev = &uiodevs[x];
+		if((io[x] == 0 && !fake[x]) || uiodev->state == NULL)
+			continue;
+		
+		// Stop everything that touches the registers before giving them up
+		if (uiodev->irq)
+			free_irq(uiodev->irq, uiodev);
+		else if (uiodev->base_port)
+			hrtimer_cancel(&uiodev->poll_timer);
+
+		hrtimer_cancel(&uiodev->pwm_timer);
+
+		for (i = 0; i < MAX_PULSES; i++)
+			hrtimer_cancel(&uiodev->pulses[i].timer);
+
+		hrtimer_cancel(&uiodev->cos_timer);
+
+		// Last, the handlers above queue events and so can re-arm it
+		hrtimer_cancel(&uiodev->mod_timer);
+
+		if (uiodev->base_port && !uiodev->fake)
+			release_region(uiodev->base_port, 0x10);
+
+		cdev_del(&uiodevs[x].cdev);
+		
+		device_destroy(uio48_class, uio48_devno+x);
+
+		free_dev(uiodev);
+
+		if (uiodev->evfd)
+			eventfd_ctx_put(uiodev->evfd);
+
+	}
+
+	if (agg.registered) {
+		cdev_del(&agg.cdev);
+		device_destroy(uio48_class, uio48_devno + MAX_CHIPS);
+	}
+
+	class_destroy(uio48_class);
+	unregister_chrdev_region(uio48_devno, MAX_CHIPS + 1);
+}
+
+// ******************* Device Subroutines *****************************
+
+static void init_io(struct uio48_dev *uiodev, unsigned base_port)
+{
+	int x, ret_val;
+
+	// obtain lock
+	ret_val = uio48_mtx_lock(uiodev);
+
+	// save the address for later use
+	uiodev->base_port = base_port;
+
+	// Clear all of the I/O ports. This also makes them inputs
+	for (x = 0; x < 6; x++)
+		uio_outb(uiodev, 0, base_port + x);
+
+	// Clear the image values as well
+	for (x = 0; x < 6; x++)
+		uiodev->shadow->port_images[x] = 0;
+
+	// set lock image to default value in device
+	uiodev->lock_image = uio_inb(uiodev, base_port + 7) & 0x3F; // clear page bits
+	
+	// Set page 2 access, for interrupt enables
+	uio_outb(uiodev, PAGE2 | uiodev->lock_image, base_port + 7);
+
+	// Clear all interrupt enables
+	uio_outb(uiodev, 0, base_port + 8);
+	uio_outb(uiodev, 0, base_port + 9);
+	uio_outb(uiodev, 0, base_port + 0x0a);
+
+	// default to page 3 register access for fast isr
+	uio_outb(uiodev, PAGE3 | uiodev->lock_image, base_port + 7);
+
+	// nothing else runs yet, but keep the state page protocol anyway
+	uio48_spnlck_lock_irq(uiodev);
+	publish_images(uiodev);
+	uio48_spnlck_unlock_irq(uiodev);
+
+	//release lock
+	uio48_mtx_unlock(uiodev);
+}
+
+static int read_bit(struct uio48_dev *uiodev, int bit_number)
+{
+	unsigned port;
+	int val;
+
+	// Adjust bit_number to 0 to 47 numbering
+	--bit_number;
+
+	// Calculate the I/O port address based on the updated bit_number
+	port = (bit_number / 8) + uiodev->base_port;
+
+	// Get the current contents of the port
+	val = uio_inb(uiodev, port);
+
+	// Get just the bit we specified
+	val = val & (1 << (bit_number % 8));
+
+	if(val)
+		return 1;
+
+	return 0;
+}
+
+// Update the bits of an output port selected by mask. Each port has its
+// own lock, so writers of different ports never contend. It is a spinlock
+// because the pulse timers write outputs from hard irq context, and nests
+// inside img_lock.
+static void update_port(struct uio48_dev *uiodev, int port, unsigned mask, unsigned val)
+{
+	unsigned long flags;
+	u64 start;
+
+	// obtain lock before writing
+	spin_lock_irqsave(&uiodev->port_lock[port], flags);
+	trace_uio48_lock_acquire(uiodev->chip, UIO48_LOCK_PORT);
+	start = lock_clock();
+
+	__update_port(uiodev, port, mask, val);
+
+	//release lock
+	lock_held(&uiodev->port_hold_hist, start);
+	trace_uio48_lock_release(uiodev->chip, UIO48_LOCK_PORT);
+	spin_unlock_irqrestore(&uiodev->port_lock[port], flags);
+}
+
+// Called with the port's port_lock held
+// The output images live in the shadow page, which the direct I/O
+// backend of the user library maps writable and updates without taking
+// any lock. Kernel writers are still serialized by port_lock but have to
+// merge their change into the image with cmpxchg.
+static void __update_port(struct uio48_dev *uiodev, int port, unsigned mask, unsigned val)
+{
+	u32 *img = &uiodev->shadow->port_images[port];
+	u32 old, temp;
+
+	// Use the image value to avoid having to read the port first
+	old = READ_ONCE(*img);
+	do {
+		temp = (old & ~mask) | (val & mask);
+	} while (!try_cmpxchg(img, &old, temp));
+
+	// Now actally update the port
+	flush_port(uiodev, port);
+}
+
+// Write the image of an output port to the hardware, again if the image
+// changed while we did, so the last image update reaches the port no
+// matter which writer made it.
+static void flush_port(struct uio48_dev *uiodev, int port)
+{
+	u32 *img = &uiodev->shadow->port_images[port];
+	u32 temp;
+
+	do {
+		temp = READ_ONCE(*img);
+		uio_outb(uiodev, temp, uiodev->base_port + port);
+		smp_mb();
+	} while (temp != READ_ONCE(*img));
+
+	state_begin(uiodev);
+	uiodev->state->port_images[port] = temp;
+	state_end(uiodev);
+}
+
+static void write_bit(struct uio48_dev *uiodev, int bit_number, int val)
+{
+	unsigned mask;
+
+	// Adjust bit number for 0 based numbering
+	--bit_number;
+
+	// Calculate a bit mask for the specified bit
+	mask = (1 << (bit_number % 8));
+
+	// Only the specified bit is affected
+	update_port(uiodev, bit_number / 8, mask, val ? mask : 0);
+}
+
+// Drive the bits in req->mask to the active level and schedule their
+// return to the inactive level. Returns the pulse slot used.
+static int start_pulse(struct uio48_dev *uiodev, struct uio48_pulse *req)
+{
+	struct uio48_pulse_slot *slot = NULL;
+	u64 mask = req->mask & UIO48_ALL_BITS;
+	unsigned long flags;
+	int i;
+
+	if (mask == 0 || req->width_us == 0 || req->width_us > MAX_PULSE_US)
+		return -EINVAL;
+
+	spin_lock_irqsave(&uiodev->img_lock, flags);
+
+	// A bit can only be part of one pulse at a time, and not under PWM
+	if ((uiodev->pulse_mask | uiodev->pwm_mask) & mask) {
+		spin_unlock_irqrestore(&uiodev->img_lock, flags);
+		return -EBUSY;
+	}
+
+	for (i = 0; i < MAX_PULSES; i++) {
+		if (uiodev->pulses[i].mask == 0) {
+			slot = &uiodev->pulses[i];
+			break;
+		}
+	}
+
+	if (slot == NULL) {
+		spin_unlock_irqrestore(&uiodev->img_lock, flags);
+		return -EBUSY;
+	}
+
+	slot->mask = mask;
+	slot->polarity = req->polarity;
+	slot->notify = req->flags & UIO48_PULSE_NOTIFY;
+	uiodev->pulse_mask |= mask;
+
+	for (i = 0; i < 6; i++) {
+		if ((mask >> (i * 8)) & 0xff)
+			update_port(uiodev, i, (mask >> (i * 8)) & 0xff,
+				    req->polarity ? 0xff : 0);
+	}
+
+	// The width is timed from after the leading edge has been written
+	hrtimer_start(&slot->timer, us_to_ktime(req->width_us), HRTIMER_MODE_REL);
+
+	spin_unlock_irqrestore(&uiodev->img_lock, flags);
+
+	return slot - uiodev->pulses;
+}
+
+static void UIO48_set_bit(struct uio48_dev *uiodev, int bit_num)
+{
+	write_bit(uiodev, bit_num, 1);
+}
+
+// Start, change or stop the PWM channel of one output bit
+static int set_pwm(struct uio48_dev *uiodev, struct uio48_pwm *req)
+{
+	struct uio48_pwm_chan *chan;
+	int bit_number = req->bit - 1;
+	unsigned mask = 1 << (bit_number % 8);
+	unsigned long flags;
+	u64 next;
+
+	if (bit_number < 0 || bit_number >= 48)
+		return -EINVAL;
+
+	if (req->period_us &&
+	    (req->period_us < MIN_PWM_PERIOD_US || req->period_us > MAX_PWM_PERIOD_US ||
+	     req->duty_us > req->period_us))
+		return -EINVAL;
+
+	chan = &uiodev->pwm[bit_number];
+
+	spin_lock_irqsave(&uiodev->img_lock, flags);
+
+	if ((uiodev->pulse_mask >> bit_number) & 1) {
+		spin_unlock_irqrestore(&uiodev->img_lock, flags);
+		return -EBUSY;
+	}
+
+	// A stopped, 0% or 100% channel is just a static level. The timer
+	// stops by itself when the last channel goes away.
+	if (req->period_us == 0 || req->duty_us == 0 || req->duty_us == req->period_us) {
+		uiodev->pwm_mask &= ~(1ULL << bit_number);
+		update_port(uiodev, bit_number / 8, mask,
+			    (req->period_us && req->duty_us) ? mask : 0);
+		spin_unlock_irqrestore(&uiodev->img_lock, flags);
+		return SUCCESS;
+	}
+
+	chan->high_ns = (u64)req->duty_us * NSEC_PER_USEC;
+	chan->low_ns = (u64)(req->period_us - req->duty_us) * NSEC_PER_USEC;
+	chan->level = 1;
+	chan->next = ktime_get_ns() + chan->high_ns;
+
+	update_port(uiodev, bit_number / 8, mask, mask);
+
+	uiodev->pwm_mask |= 1ULL << bit_number;
+
+	// Only re-arm if this channel needs the timer earlier
+	next = pwm_next_edge(uiodev);
+
+	if (!hrtimer_is_queued(&uiodev->pwm_timer) ||
+	    ktime_to_ns(hrtimer_get_expires(&uiodev->pwm_timer)) > next)
+		hrtimer_start(&uiodev->pwm_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+
+	spin_unlock_irqrestore(&uiodev->img_lock, flags);
+
+	return SUCCESS;
+}
+
+// Earliest pending edge over all PWM channels. Called with img_lock held.
+static u64 pwm_next_edge(struct uio48_dev *uiodev)
+{
+	u64 next = U64_MAX;
+	int i;
+
+	for (i = 0; i < 48; i++) {
+		if (((uiodev->pwm_mask >> i) & 1) && uiodev->pwm[i].next < next)
+			next = uiodev->pwm[i].next;
+	}
+
+	return next;
+}
+
+static void clr_bit(struct uio48_dev *uiodev, int bit_num)
+{
+	write_bit(uiodev, bit_num, 0);
+}
+
+static void enab_int(struct uio48_dev *uiodev, int bit_number, int polarity)
+{
+	unsigned port;
+	unsigned temp;
+	unsigned mask;
+	unsigned base_port = uiodev->base_port;
+    unsigned long flags;
+	u64 start;
+
+	// Ports 3-5 have no interrupt hardware, sample them instead
+	if (bit_number > 24) {
+		enab_cos(uiodev, bit_number, polarity);
+		return;
+	}
+
+	// Also adjust bit number
+	--bit_number;
+
+	// page and lock register sequences must not interleave with the ISR
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	start = lock_clock();
+
+	// Calculate the I/O address based upon bit number
+	port = (bit_number / 8) + base_port + 8;
+
+	// Calculate a bit mask based upon the specified bit number
+	mask = (1 << (bit_number % 8));
+
+	// Turn on page 2 access
+	uio_outb(uiodev, PAGE2 | uiodev->lock_image, base_port + 7);
+
+	// Get the current state of the interrupt enable register
+	temp = uio_inb(uiodev, port);
+
+	// Set the enable bit for our bit number
+	temp = temp | mask;
+
+	// Now update the interrupt enable register
+	uio_outb(uiodev, temp,port);
+
+	// Turn on access to page 1 for polarity control
+	uio_outb(uiodev, PAGE1 | uiodev->lock_image, base_port + 7);
+
+	// Get the current state of the polarity register
+	temp = uio_inb(uiodev, port);
+
+	// Set the polarity according to the argument in the image value
+	if (polarity)
+		temp = temp | mask;
+	else
+		temp = temp & ~mask;
+
+	// Write out the new polarity value
+	uio_outb(uiodev, temp, port);
+
+	// Keep the images in step, the ISR uses them to tag the edge
+	uiodev->enab_image[bit_number / 8] |= mask;
+	uiodev->pol_image[bit_number / 8] = temp;
+	publish_images(uiodev);
+
+	// Set access back to page 3
+	uio_outb(uiodev, PAGE3 | uiodev->lock_image, base_port + 7);
+
+	//release lock
+	lock_held(&uiodev->page_hold_hist, start);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+}
+
+static void disab_int(struct uio48_dev *uiodev, int bit_number)
+{
+	unsigned port;
+	unsigned temp;
+	unsigned mask;
+	unsigned base_port = uiodev->base_port;
+    unsigned long flags;
+	u64 start;
+
+	if (bit_number > 24) {
+		disab_cos(uiodev, bit_number);
+		return;
+	}
+
+	// Also adjust bit number
+	--bit_number;
+
+	// page and lock register sequences must not interleave with the ISR
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	start = lock_clock();
+
+	// Calculate the I/O address based upon bit number
+	port = (bit_number / 8) + base_port + 8;
+
+	// Calculate a bit mask based upon the specified bit number
+	mask = (1 << (bit_number % 8));
+
+	// Turn on page 2 access
+	uio_outb(uiodev, PAGE2 | uiodev->lock_image, base_port + 7);
+
+	// Get the current state of the interrupt enable register
+	temp = uio_inb(uiodev, port);
+
+	// clear the enable bit for our bit number
+	temp = temp & ~mask;
+
+	// Now update the interrupt enable register
+	uio_outb(uiodev, temp, port);
+
+	uiodev->enab_image[bit_number / 8] &= ~mask;
+	publish_images(uiodev);
+
+	// Set access back to page 3
+	uio_outb(uiodev, PAGE3 | uiodev->lock_image, base_port + 7);
+
+	//release lock
+	lock_held(&uiodev->page_hold_hist, start);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+}
+
+static void clr_int(struct uio48_dev *uiodev, int bit_number)
+{
+	unsigned port;
+	unsigned temp;
+	unsigned mask;
+	unsigned base_port = uiodev->base_port;
+	unsigned long flags;
+	u64 start;
+
+	// Sampled bits have no latched interrupt to clear
+	if (bit_number > 24)
+		return;
+
+	// Adjust bit number
+	--bit_number;
+
+	// obtain lock, the ISR takes it too
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	start = lock_clock();
+
+	// Calculate the I/O address based upon bit number
+	port = (bit_number / 8) + base_port + 8;
+
+	// Calculate a bit mask based upon the specified bit number
+	mask = (1 << (bit_number % 8));
+
+	// Turn on page 2 access
+	uio_outb(uiodev, PAGE2 | uiodev->lock_image, base_port + 7);
+
+	// Get the current state of the interrupt enable register
+	temp = uio_inb(uiodev, port);
+
+	// Temporarily clear only our enable. This clears the interrupt
+	temp = temp & ~mask;    // Clear the enable for this bit
+
+	// Now update the interrupt enable register
+	uio_outb(uiodev, temp, port);
+
+	// Re-enable our interrupt bit
+	temp = temp | mask;
+
+	uio_outb(uiodev, temp, port);
+
+	// Set access back to page 3
+	uio_outb(uiodev, PAGE3 | uiodev->lock_image, base_port + 7);
+
+	//release lock
+	lock_held(&uiodev->page_hold_hist, start);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+}
+
+static void enab_cos(struct uio48_dev *uiodev, int bit_number, int polarity)
+{
+	unsigned port;
+	unsigned mask;
+	unsigned long flags;
+
+	// only ports 3-5 are sampled, never index past the images
+	if (WARN_ON_ONCE(bit_number < 25 || bit_number > 48))
+		return;
+
+	// Adjust bit number
+	--bit_number;
+
+	port = bit_number / 8;
+	mask = (1 << (bit_number % 8));
+
+	// obtain lock, the sampler takes it too
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	// Take a fresh reference sample so enabling does not report an edge
+	if (uiodev->enab_image[port] == 0)
+		uiodev->input_image[port] = uio_inb(uiodev, uiodev->base_port + port);
+
+	uiodev->enab_image[port] |= mask;
+
+	if (polarity)
+		uiodev->pol_image[port] |= mask;
+	else
+		uiodev->pol_image[port] &= ~mask;
+
+	publish_images(uiodev);
+
+	// Start the sampler if this is the first sampled bit
+	if (!hrtimer_is_queued(&uiodev->cos_timer))
+		hrtimer_start(&uiodev->cos_timer, uiodev->cos_period, HRTIMER_MODE_REL);
+
+	//release lock
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+}
+
+static void disab_cos(struct uio48_dev *uiodev, int bit_number)
+{
+	unsigned long flags;
+
+	if (WARN_ON_ONCE(bit_number < 25 || bit_number > 48))
+		return;
+
+	// Adjust bit number
+	--bit_number;
+
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	// The sampler stops by itself once nothing is enabled
+	uiodev->enab_image[bit_number / 8] &= ~(1 << (bit_number % 8));
+	publish_images(uiodev);
+
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+}
+
+static int get_int(struct uio48_dev *uiodev)
+{
+	unsigned base_port = uiodev->base_port;
+	int i, t;//, ret = 0;
+
+	uio48_spnlck_lock(uiodev);
+
+	/* Read the master interrupt pending register, mask off undefined
+	 * bits. */
+	t = uio_inb(uiodev, base_port + 6) & 0x07;
+
+	/* If there are no pending interrupts, return 0. */
+	if (t == 0) {
+		uio48_spnlck_unlock(uiodev);
+		return 0;
+	}
+
+	/* Check ports 0, 1, and 2 for interrupt ID register. */
+	for (i = 0; i < 3; i++) {
+		/* Read the interrupt ID register if necessary */
+		if ((t >> i) & 1) {
+   			uiodev->irq_image[i] = uio_inb(uiodev, base_port + 8 + i);
+
+			// clear irq
+   			uio_outb(uiodev, 0, base_port + 8 + i);
+		}
+		else
+			uiodev->irq_image[i] = 0;
+
+	}
+
+	uio48_spnlck_unlock(uiodev);
+
+	return 1;
+}
+
+static int get_buffered_int(struct uio48_dev *uiodev)
+{
+	struct uio48_event ev;
+
+	if (get_events(uiodev, &ev, 1))
+		return ev.bit;
+
+	return 0;
+}
+
+// Dequeue up to max events. Returns the number of events copied.
+static int get_events(struct uio48_dev *uiodev, struct uio48_event *evs, int max)
+{
+	struct uio48_ring *ring = &uiodev->ring;
+	unsigned long flags;
+	int n = 0, i;
+	u64 now;
+
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	while (n < max && ring->outptr != ring->inptr) {
+		evs[n++] = ring->buf[ring->outptr];
+		ring->outptr = (ring->outptr + 1) & (MAX_INTS - 1);
+	}
+
+	if (n)
+		trace_uio48_dequeue(uiodev->chip, n,
+				    (ring->inptr - ring->outptr) & (MAX_INTS - 1));
+
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+	if (n) {
+		now = ktime_get_ns();
+
+		for (i = 0; i < n; i++)
+			hist_add(&uiodev->event_hist, now - evs[i].timestamp);
+	}
+
+	return n;
+}
+
+// Wait condition: true once the moderation thresholds are met
+static bool events_due(struct uio48_dev *uiodev)
+{
+	unsigned long flags;
+	bool due;
+
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	due = __events_due(uiodev);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+	return due;
+}
+
+// events_due() with spnlck held
+static bool __events_due(struct uio48_dev *uiodev)
+{
+	struct uio48_ring *ring = &uiodev->ring;
+	int depth;
+
+	depth = (ring->inptr - ring->outptr) & (MAX_INTS - 1);
+
+	if (depth >= uiodev->mod_count)
+		return true;
+
+	return depth && uiodev->mod_usecs &&
+	       ktime_get_ns() >= ring->buf[ring->outptr].timestamp +
+				 (u64)uiodev->mod_usecs * NSEC_PER_USEC;
+}
+
+// Add an event to the ring. Called with spnlck held.
+static void queue_event(struct uio48_dev *uiodev, int bit_number, u64 timestamp,
+			int flags)
+{
+	struct uio48_ring *ring = &uiodev->ring;
+	struct uio48_event *ev = &ring->buf[ring->inptr];
+
+	ev->timestamp = timestamp;
+	ev->bit = bit_number;
+	ev->chip = uiodev->chip;
+	ev->flags = flags;
+	memset(ev->reserved, 0, sizeof(ev->reserved));
+
+	ring->inptr = (ring->inptr + 1) & (MAX_INTS - 1);
+
+	// when full, drop the oldest event instead of the whole queue
+	if (ring->inptr == ring->outptr) {
+		ring->outptr = (ring->outptr + 1) & (MAX_INTS - 1);
+		uiodev->overruns++;
+	}
+
+	trace_uio48_enqueue(uiodev->chip, bit_number, flags,
+			    (ring->inptr - ring->outptr) & (MAX_INTS - 1));
+
+	uiodev->unsignalled++;
+
+	agg_queue(ev);
+
+	state_begin(uiodev);
+	uiodev->state->bit_counts[bit_number - 1]++;
+	uiodev->state->overruns = uiodev->overruns;
+	state_end(uiodev);
+}
+
+// Wake waiters if the moderation thresholds are met, otherwise make sure
+// the deadline timer is armed for the oldest event. Called with spnlck held.
+static void moderate(struct uio48_dev *uiodev)
+{
+	struct uio48_ring *ring = &uiodev->ring;
+	int depth = (ring->inptr - ring->outptr) & (MAX_INTS - 1);
+	u64 deadline;
+
+	if (depth == 0)
+		return;
+
+	if (depth >= uiodev->mod_count) {
+		hrtimer_try_to_cancel(&uiodev->mod_timer);
+		notify_events(uiodev);
+		return;
+	}
+
+	if (uiodev->mod_usecs && !hrtimer_is_queued(&uiodev->mod_timer)) {
+		deadline = ring->buf[ring->outptr].timestamp +
+			   (u64)uiodev->mod_usecs * NSEC_PER_USEC;
+		hrtimer_start(&uiodev->mod_timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+	}
+}
+
+// Wake the readers and signal the eventfd and SIGIO listeners. Called
+// with spnlck held.
+static void notify_events(struct uio48_dev *uiodev)
+{
+	struct uio48_ring *ring = &uiodev->ring;
+
+	trace_uio48_wakeup(uiodev->chip, (ring->inptr - ring->outptr) & (MAX_INTS - 1));
+
+	// one exclusive waiter per event, every shared waiter
+	wake_up_nr(&uiodev->wq, (ring->inptr - ring->outptr) & (MAX_INTS - 1));
+
+	// aggregate readers sleep until some chip's moderation says so
+	wake_up(&agg.wq);
+
+	// the eventfd counter adds up the events queued since the last signal,
+	// 6.8 dropped the count argument so there it adds one per wakeup
+	if (uiodev->evfd && uiodev->unsignalled)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(uiodev->evfd);
+#else
+		eventfd_signal(uiodev->evfd, uiodev->unsignalled);
+#endif
+
+	uiodev->unsignalled = 0;
+
+	kill_fasync(&uiodev->async_queue, SIGIO, POLL_IN);
+
+	uring_notify(uiodev);
+}
+
+// Sleep as an exclusive waiter until events are due. Only one waiter is
+// woken per event, so one that leaves without taking it passes it on.
+static int wait_exclusive(struct uio48_dev *uiodev)
+{
+	int ret_val;
+
+	ret_val = wait_event_interruptible_exclusive(uiodev->wq, events_due(uiodev));
+
+	if (ret_val && events_due(uiodev))
+		wake_up(&uiodev->wq);
+
+	return ret_val;
+}
 
-		sprintf(uiodev->name, KBUILD_MODNAME "%c", 'a' + x);
+// In exclusive mode, wake the next waiter if events are still due after
+// this one took its share
+static void pass_wakeup(struct uio48_dev *uiodev)
+{
+	if (READ_ONCE(uiodev->exclusive) && events_due(uiodev))
+		wake_up(&uiodev->wq);
+}
 
-		pr_info("[%s] Added new device\n", uiodev->name);
+// Register the eventfd fd, replacing any previous one. -1 unregisters.
+static int set_eventfd(struct uio48_dev *uiodev, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
 
-		device_create(uio48_class, NULL, dev, NULL, "%s", uiodev->name);
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
 	}
 
-	if (io_num)
-		return 0;
+	uio48_spnlck_lock_irqsave(uiodev, flags);
 
-	pr_warn("No resources available, driver terminating\n");
+	old = uiodev->evfd;
+	uiodev->evfd = ctx;
+	uiodev->unsignalled = 0;
 
-	class_destroy(uio48_class);
-	unregister_chrdev_region(uio48_devno, MAX_CHIPS);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
 
-	return -ENODEV;
+	if (old)
+		eventfd_ctx_put(old);
+
+	return SUCCESS;
 }
 
-///**********************************************************************
-//			CLEANUP MODULE
-///**********************************************************************
-// unregister the appropriate file from /proc
-void cleanup_module()
+// Read the ports covered by mask as a 48 bit value, bit 1 in bit 0
+static u64 read_inputs(struct uio48_dev *uiodev, u64 mask)
 {
-	int x;
-
-	/* Unregister I/O port usage and IRQ */
-	for (x = 0; x < MAX_CHIPS; x++) {
-		struct uio48_dev *uiodev = &uiodevs[x];
-		if(io[x] == 0)
-			continue;
-		
-		if (uiodev->base_port)
-			release_region(uiodev->base_port, 0x10);
-
-		if (uiodev->irq)
-			free_irq(uiodev->irq, uiodev);
-		
-		cdev_del(&uiodevs[x].cdev);
-		
-		device_destroy(uio48_class, uio48_devno+x);
+	u64 state = 0;
+	int i;
 
+	for (i = 0; i < 6; i++) {
+		if ((mask >> (i * 8)) & 0xff)
+			state |= (u64)uio_inb(uiodev, uiodev->base_port + i) << (i * 8);
 	}
 
-	class_destroy(uio48_class);
-	unregister_chrdev_region(uio48_devno, MAX_CHIPS);
+	return state;
 }
 
-// ******************* Device Subroutines *****************************
-
-static void init_io(struct uio48_dev *uiodev, unsigned base_port)
+// Wake the pattern waiters matched by state. Called with spnlck held.
+static void check_patterns(struct uio48_dev *uiodev, u64 state)
 {
-	int x, ret_val;
+	struct uio48_pattern_waiter *w, *tmp;
+	u64 mask = 0;
+
+	list_for_each_entry_safe(w, tmp, &uiodev->pattern_waiters, list) {
+		if ((state & w->mask) == w->value) {
+			// an empty list entry tells the waiter it matched
+			list_del_init(&w->list);
+			complete(&w->done);
+		} else {
+			mask |= w->mask;
+		}
+	}
 
-	// obtain lock
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	uiodev->pattern_mask = mask;
+}
 
-	// save the address for later use
-	uiodev->base_port = base_port;
+static int wait_pattern(struct uio48_dev *uiodev, u64 mask, u64 value,
+			unsigned timeout_ms)
+{
+	struct uio48_pattern_waiter w, *p;
+	unsigned long flags;
+	long ret;
 
-	// Clear all of the I/O ports. This also makes them inputs
-	for (x = 0; x < 6; x++)
-		outb(0, base_port + x);
+	w.mask = mask & UIO48_ALL_BITS;
+	w.value = value & w.mask;
+	init_completion(&w.done);
 
-	// Clear the image values as well
-	for (x = 0; x < 6; x++)
-		uiodev->port_images[x] = 0;
+	uio48_spnlck_lock_irqsave(uiodev, flags);
 
-	// set lock image to default value in device
-	uiodev->lock_image = inb(base_port + 7) & 0x3F; // clear page bits
-	
-	// Set page 2 access, for interrupt enables
-	outb(PAGE2 | uiodev->lock_image, base_port + 7);
+	// The pattern may already be satisfied
+	if ((read_inputs(uiodev, w.mask) & w.mask) == w.value) {
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
+		return 0;
+	}
 
-	// Clear all interrupt enables
-	outb(0, base_port + 8);
-	outb(0, base_port + 9);
-	outb(0, base_port + 0x0a);
+	list_add_tail(&w.list, &uiodev->pattern_waiters);
+	uiodev->pattern_mask |= w.mask;
 
-	// default to page 3 register access for fast isr
-	outb(PAGE3 | uiodev->lock_image, base_port + 7);
+	// Ports 3-5 are only seen by the sampler, make sure it runs
+	if ((w.mask >> 24) && !hrtimer_is_queued(&uiodev->cos_timer))
+		hrtimer_start(&uiodev->cos_timer, uiodev->cos_period, HRTIMER_MODE_REL);
 
-	//release lock
-	mutex_unlock(&uiodev->mtx);
-}
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
 
-static int read_bit(struct uio48_dev *uiodev, int bit_number)
-{
-	unsigned port;
-	int val;
+	ret = wait_for_completion_interruptible_timeout(&w.done,
+			timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT);
 
-	// Adjust bit_number to 0 to 47 numbering
-	--bit_number;
+	uio48_spnlck_lock_irqsave(uiodev, flags);
 
-	// Calculate the I/O port address based on the updated bit_number
-	port = (bit_number / 8) + uiodev->base_port;
+	// A match wins over a racing timeout or signal
+	if (list_empty(&w.list)) {
+		ret = 0;
+	} else {
+		list_del(&w.list);
 
-	// Get the current contents of the port
-	val = inb(port);
+		uiodev->pattern_mask = 0;
+		list_for_each_entry(p, &uiodev->pattern_waiters, list)
+			uiodev->pattern_mask |= p->mask;
 
-	// Get just the bit we specified
-	val = val & (1 << (bit_number % 8));
+		if (ret == 0)
+			ret = -ETIMEDOUT;
+	}
 
-	if(val)
-		return 1;
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
 
-	return 0;
+	return ret;
 }
 
-static void write_bit(struct uio48_dev *uiodev, int bit_number, int val)
+// Execute one command of a command list. Called with mtx held, which only
+// keeps other lists out, or alone from device_uring_cmd(), which refuses
+// UIO48_OP_DELAY. Each command takes its own port or page lock, so other
+// ioctls can run between two commands.
+static int run_cmd(struct uio48_dev *uiodev, struct uio48_cmd *cmd)
 {
-	unsigned port;
+	unsigned base_port = uiodev->base_port;
+	unsigned long flags;
 	unsigned temp;
-	unsigned mask;
-    int ret_val;
 
-	// Adjust bit number for 0 based numbering
-	--bit_number;
+	switch (cmd->op) {
+	case UIO48_OP_READ_PORT:
+		if (cmd->port > 0x0f)
+			return -EINVAL;
+		return uio_inb(uiodev, base_port + cmd->port);
 
-	// obtain lock before writing
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	case UIO48_OP_WRITE_PORT:
+	case UIO48_OP_WRITE_MASKED:
+		if (cmd->port > 0x0f)
+			return -EINVAL;
 
-	// Calculate the I/O address of the port based on the bit number
-	port = (bit_number / 8) + uiodev->base_port;
+		temp = cmd->op == UIO48_OP_WRITE_PORT ? 0xff : cmd->mask;
 
-	// Use the image value to avoid having to read the port first
-	temp = uiodev->port_images[bit_number / 8];
+		if (cmd->port < 6) {
+			update_port(uiodev, cmd->port, temp, cmd->value);
+			return SUCCESS;
+		}
 
-	// Calculate a bit mask for the specified bit
-	mask = (1 << (bit_number % 8));
+		// other registers depend on the page, keep clear of the ISR
+		uio48_spnlck_lock_irqsave(uiodev, flags);
+		if (temp != 0xff)
+			temp = (uio_inb(uiodev, base_port + cmd->port) & ~temp) | (cmd->value & temp);
+		else
+			temp = cmd->value;
+		uio_outb(uiodev, temp, base_port + cmd->port);
+		uio48_spnlck_unlock_irqrestore(uiodev, flags);
+		return SUCCESS;
 
-	// check whether the request was to set or clear and mask accordingly
-	if(val)		// If the bit needs to be set
-		temp = temp | mask;
-	else
-		temp = temp & ~mask;
+	case UIO48_OP_READ_BIT:
+	case UIO48_OP_SET_BIT:
+	case UIO48_OP_CLR_BIT:
+	case UIO48_OP_ENAB_INT:
+	case UIO48_OP_DISAB_INT:
+		if (cmd->port < 1 || cmd->port > 48)
+			return -EINVAL;
+
+		if (cmd->op == UIO48_OP_READ_BIT)
+			return read_bit(uiodev, cmd->port);
+		else if (cmd->op == UIO48_OP_SET_BIT)
+			write_bit(uiodev, cmd->port, 1);
+		else if (cmd->op == UIO48_OP_CLR_BIT)
+			write_bit(uiodev, cmd->port, 0);
+		else if (cmd->op == UIO48_OP_ENAB_INT)
+			enab_int(uiodev, cmd->port, cmd->value);
+		else
+			disab_int(uiodev, cmd->port);
+		return SUCCESS;
 
-	// Update the image value with the value we're about to write
-	uiodev->port_images[bit_number /8] = temp;
+	case UIO48_OP_LOCK_PORT:
+	case UIO48_OP_UNLOCK_PORT:
+		if (cmd->port > 5)
+			return -EINVAL;
 
-	// Now actally update the port. Only the specified bit is affected
-	outb(temp, port);
+		if (cmd->op == UIO48_OP_LOCK_PORT)
+			lock_port(uiodev, cmd->port);
+		else
+			unlock_port(uiodev, cmd->port);
+		return SUCCESS;
 
-	//release lock
-	mutex_unlock(&uiodev->mtx);
-}
+	case UIO48_OP_DELAY:
+		if (cmd->arg > UIO48_MAX_DELAY_US)
+			return -EINVAL;
 
-static void UIO48_set_bit(struct uio48_dev *uiodev, int bit_num)
-{
-	write_bit(uiodev, bit_num, 1);
-}
+		if (cmd->arg < 10)
+			udelay(cmd->arg);
+		else
+			usleep_range(cmd->arg, cmd->arg + cmd->arg / 8);
+		return SUCCESS;
 
-static void clr_bit(struct uio48_dev *uiodev, int bit_num)
-{
-	write_bit(uiodev, bit_num, 0);
+	default:
+		return -EINVAL;
+	}
 }
 
-static void enab_int(struct uio48_dev *uiodev, int bit_number, int polarity)
+// Execute a command list under a single acquisition of mtx. Every result
+// is written back; commands after the first failure are not run.
+static int run_cmd_list(struct uio48_dev *uiodev, struct uio48_cmd_list *list)
 {
-	unsigned port;
-	unsigned temp;
-	unsigned mask;
-	unsigned base_port = uiodev->base_port;
-    int ret_val;
-
-	// Also adjust bit number
-	--bit_number;
+	struct uio48_cmd __user *ucmds = u64_to_user_ptr(list->cmds);
+	struct uio48_cmd *cmds;
+	int i, ret = SUCCESS;
 
-	// obtain lock
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	if (list->version != UIO48_CMD_VERSION)
+		return -EINVAL;
 
-	// Calculate the I/O address based upon bit number
-	port = (bit_number / 8) + base_port + 8;
+	if (list->count == 0)
+		return SUCCESS;
 
-	// Calculate a bit mask based upon the specified bit number
-	mask = (1 << (bit_number % 8));
+	if (list->count > UIO48_MAX_CMDS)
+		return -E2BIG;
 
-	// Turn on page 2 access
-	outb(PAGE2 | uiodev->lock_image, base_port + 7);
+	cmds = kmalloc_array(list->count, sizeof(*cmds), GFP_KERNEL);
+	if (cmds == NULL)
+		return -ENOMEM;
 
-	// Get the current state of the interrupt enable register
-	temp = inb(port);
+	if (copy_from_user(cmds, ucmds, list->count * sizeof(*cmds))) {
+		kfree(cmds);
+		return -EFAULT;
+	}
 
-	// Set the enable bit for our bit number
-	temp = temp | mask;
+	if (uio48_mtx_lock(uiodev)) {
+		kfree(cmds);
+		return -ERESTARTSYS;
+	}
 
-	// Now update the interrupt enable register
-	outb(temp,port);
+	for (i = 0; i < list->count; i++) {
+		if (ret < 0) {
+			cmds[i].result = -ECANCELED;
+			continue;
+		}
 
-	// Turn on access to page 1 for polarity control
-	outb(PAGE1 | uiodev->lock_image, base_port + 7);
+		cmds[i].result = run_cmd(uiodev, &cmds[i]);
 
-	// Get the current state of the polarity register
-	temp = inb(port);
+		if (cmds[i].result < 0)
+			ret = cmds[i].result;
+	}
 
-	// Set the polarity according to the argument in the image value
-	if (polarity)
-		temp = temp | mask;
-	else
-		temp = temp & ~mask;
+	uio48_mtx_unlock(uiodev);
 
-	// Write out the new polarity value
-	outb(temp, port);
+	if (copy_to_user(ucmds, cmds, list->count * sizeof(*cmds)))
+		ret = -EFAULT;
 
-	// Set access back to page 3
-	outb(PAGE3 | uiodev->lock_image, base_port + 7);
+	kfree(cmds);
 
-	//release lock
-	mutex_unlock(&uiodev->mtx);
+	return ret;
 }
 
-static void disab_int(struct uio48_dev *uiodev, int bit_number)
+// Read-modify-write a paged register of port 0-2 (PAGE1 polarity, PAGE2
+// enable) and return to page 3. Called with spnlck held.
+static unsigned __update_paged(struct uio48_dev *uiodev, int page, int port,
+			       unsigned mask, unsigned val)
 {
-	unsigned port;
-	unsigned temp;
-	unsigned mask;
 	unsigned base_port = uiodev->base_port;
-    int ret_val;
+	unsigned temp;
 
-	// Also adjust bit number
-	--bit_number;
+	uio_outb(uiodev, page | uiodev->lock_image, base_port + 7);
 
-	// obtain lock
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	temp = (uio_inb(uiodev, base_port + 8 + port) & ~mask) | (val & mask);
+	uio_outb(uiodev, temp, base_port + 8 + port);
 
-	// Calculate the I/O address based upon bit number
-	port = (bit_number / 8) + base_port + 8;
+	uio_outb(uiodev, PAGE3 | uiodev->lock_image, base_port + 7);
 
-	// Calculate a bit mask based upon the specified bit number
-	mask = (1 << (bit_number % 8));
+	return temp;
+}
 
-	// Turn on page 2 access
-	outb(PAGE2 | uiodev->lock_image, base_port + 7);
+// Decode all encoders from the current input levels and re-arm each
+// encoder input for the opposite edge, giving both-edge interrupts.
+// Called with spnlck held.
+static void service_encoders(struct uio48_dev *uiodev)
+{
+	struct uio48_enc *enc;
+	u32 levels, armed;
+	int i, ab, pass;
+	unsigned m;
 
-	// Get the current state of the interrupt enable register
-	temp = inb(port);
+	levels = read_inputs(uiodev, uiodev->enc_mask);
 
-	// clear the enable bit for our bit number
-	temp = temp & ~mask;
+	// An input that moves while we re-arm is caught by another pass
+	for (pass = 0; pass < 4; pass++) {
+		for (i = 0; i < UIO48_MAX_ENCODERS; i++) {
+			enc = &uiodev->enc[i];
 
-	// Now update the interrupt enable register
-	outb(temp, port);
+			if (!enc->enabled)
+				continue;
 
-	// Set access back to page 3
-	outb(PAGE3 | uiodev->lock_image, base_port + 7);
+			ab = ((levels >> enc->bit_a) & 1) << 1 | ((levels >> enc->bit_b) & 1);
 
-	//release lock
-	mutex_unlock(&uiodev->mtx);
+			if (quad_table[enc->state << 2 | ab] == 2)
+				enc->errors++;
+			else
+				enc->position += quad_table[enc->state << 2 | ab];
+
+			enc->state = ab;
+		}
+
+		// Interrupt on the level each input does not have now
+		for (i = 0; i < 3; i++) {
+			m = (uiodev->enc_mask >> (i * 8)) & 0xff;
+
+			if (m && ((uiodev->pol_image[i] ^ ~(levels >> (i * 8))) & m))
+				uiodev->pol_image[i] = __update_paged(uiodev, PAGE1, i, m,
+								      ~(levels >> (i * 8)));
+		}
+
+		armed = levels;
+		levels = read_inputs(uiodev, uiodev->enc_mask);
+
+		if (((levels ^ armed) & uiodev->enc_mask) == 0)
+			break;
+	}
+
+	publish_images(uiodev);
+	publish_encoders(uiodev);
 }
 
-static void clr_int(struct uio48_dev *uiodev, int bit_number)
+static int set_encoder(struct uio48_dev *uiodev, struct uio48_encoder *req)
 {
-	unsigned port;
-	unsigned temp;
-	unsigned mask;
-	unsigned base_port = uiodev->base_port;
+	struct uio48_enc *enc;
+	unsigned long flags;
+	u32 bits, levels;
+	int i;
 
-	// Adjust bit number
-	--bit_number;
+	if (req->index >= UIO48_MAX_ENCODERS)
+		return -EINVAL;
 
-	// obtain lock
-	spin_lock(&uiodev->spnlck);
+	if (req->enable &&
+	    (req->bit_a < 1 || req->bit_a > 24 || req->bit_b < 1 || req->bit_b > 24 ||
+	     req->bit_a == req->bit_b))
+		return -EINVAL;
 
-	// Calculate the I/O address based upon bit number
-	port = (bit_number / 8) + base_port + 8;
+	enc = &uiodev->enc[req->index];
 
-	// Calculate a bit mask based upon the specified bit number
-	mask = (1 << (bit_number % 8));
+	if (uio48_mtx_lock(uiodev))
+		return -ERESTARTSYS;
 
-	// Turn on page 2 access
-	outb(PAGE2 | uiodev->lock_image, base_port + 7);
+	uio48_spnlck_lock_irqsave(uiodev, flags);
 
-	// Get the current state of the interrupt enable register
-	temp = inb(port);
+	// Release the inputs this encoder had, disabling their interrupts
+	if (enc->enabled) {
+		bits = (1 << enc->bit_a) | (1 << enc->bit_b);
 
-	// Temporarily clear only our enable. This clears the interrupt
-	temp = temp & ~mask;    // Clear the enable for this bit
+		enc->enabled = 0;
+		uiodev->enc_mask &= ~bits;
 
-	// Now update the interrupt enable register
-	outb(temp, port);
+		for (i = 0; i < 3; i++) {
+			if ((bits >> (i * 8)) & 0xff)
+				uiodev->enab_image[i] = __update_paged(uiodev, PAGE2, i,
+								       bits >> (i * 8), 0);
+		}
+	}
 
-	// Re-enable our interrupt bit
-	temp = temp | mask;
+	if (req->enable) {
+		bits = (1 << (req->bit_a - 1)) | (1 << (req->bit_b - 1));
 
-	outb(temp, port);
+		if (uiodev->enc_mask & bits) {
+			uio48_spnlck_unlock_irqrestore(uiodev, flags);
+			uio48_mtx_unlock(uiodev);
+			return -EBUSY;
+		}
 
-	// Set access back to page 3
-	outb(PAGE3 | uiodev->lock_image, base_port + 7);
+		levels = read_inputs(uiodev, bits);
 
-	//release lock
-	spin_unlock(&uiodev->spnlck);
-}
+		enc->bit_a = req->bit_a - 1;
+		enc->bit_b = req->bit_b - 1;
+		enc->state = ((levels >> enc->bit_a) & 1) << 1 | ((levels >> enc->bit_b) & 1);
+		enc->position = 0;
+		enc->errors = 0;
+		enc->enabled = 1;
 
-static int get_int(struct uio48_dev *uiodev)
-{
-	unsigned base_port = uiodev->base_port;
-	int i, t;//, ret = 0;
+		uiodev->enc_mask |= bits;
 
-	spin_lock(&uiodev->spnlck);
+		// Arm both inputs for the edge away from their current level
+		for (i = 0; i < 3; i++) {
+			if ((bits >> (i * 8)) & 0xff) {
+				uiodev->pol_image[i] = __update_paged(uiodev, PAGE1, i,
+						bits >> (i * 8), ~(levels >> (i * 8)));
+				uiodev->enab_image[i] = __update_paged(uiodev, PAGE2, i,
+						bits >> (i * 8), 0xff);
+			}
+		}
+	}
 
-	/* Read the master interrupt pending register, mask off undefined
-	 * bits. */
-	t = inb(base_port + 6) & 0x07;
+	publish_images(uiodev);
+	publish_encoders(uiodev);
 
-	/* If there are no pending interrupts, return 0. */
-	if (t == 0) {
-		spin_unlock(&uiodev->spnlck);
-		return 0;
-	}
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+	uio48_mtx_unlock(uiodev);
 
-	/* Check ports 0, 1, and 2 for interrupt ID register. */
-	for (i = 0; i < 3; i++) {
-		/* Read the interrupt ID register if necessary */
-		if ((t >> i) & 1) {
-   			uiodev->irq_image[i] = inb(base_port + 8 + i);
+	return SUCCESS;
+}
 
-			// clear irq
-   			outb(0, base_port + 8 + i);
-		}
-		else
-			uiodev->irq_image[i] = 0;
+static int get_encoder(struct uio48_dev *uiodev, struct uio48_encoder *req)
+{
+	struct uio48_enc *enc;
+	unsigned long flags;
 
-	}
+	if (req->index >= UIO48_MAX_ENCODERS)
+		return -EINVAL;
 
-	spin_unlock(&uiodev->spnlck);
+	enc = &uiodev->enc[req->index];
 
-	return 1;
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	req->bit_a = enc->enabled ? enc->bit_a + 1 : 0;
+	req->bit_b = enc->enabled ? enc->bit_b + 1 : 0;
+	req->enable = enc->enabled;
+	req->errors = enc->errors;
+	req->position = enc->position;
+
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+
+	return SUCCESS;
 }
 
-static int get_buffered_int(struct uio48_dev *uiodev)
+// The state page is a seqlock shared with user space: seq is odd while an
+// update is in progress. Writers nest state_lock inside spnlck or a port_lock,
+// so interrupts are always disabled here.
+static void state_begin(struct uio48_dev *uiodev)
 {
-	int temp;
+	spin_lock(&uiodev->state_lock);
+	WRITE_ONCE(uiodev->state->seq, uiodev->state->seq + 1);
+	smp_wmb();
+}
 
-	// for polled option, no irq selected
-	if (uiodev->irq == 0) {
-		temp = get_int(uiodev);
+static void state_end(struct uio48_dev *uiodev)
+{
+	smp_wmb();
+	WRITE_ONCE(uiodev->state->seq, uiodev->state->seq + 1);
+	spin_unlock(&uiodev->state_lock);
+}
 
-		return temp;
-	}
+// Publish the lock, enable and polarity images. Called with spnlck held.
+static void publish_images(struct uio48_dev *uiodev)
+{
+	state_begin(uiodev);
+	uiodev->state->lock_image = uiodev->lock_image;
+	memcpy(uiodev->state->enab_image, uiodev->enab_image, 6);
+	memcpy(uiodev->state->pol_image, uiodev->pol_image, 6);
+	state_end(uiodev);
+}
 
-	if (uiodev->outptr != uiodev->inptr) {
-		temp = uiodev->int_buffer[uiodev->outptr++];
+// Publish the encoder counts. Called with spnlck held.
+static void publish_encoders(struct uio48_dev *uiodev)
+{
+	int i;
 
-		if (uiodev->outptr == MAX_INTS)
-			uiodev->outptr = 0;
+	state_begin(uiodev);
 
-		return temp;
+	for (i = 0; i < UIO48_MAX_ENCODERS; i++) {
+		uiodev->state->enc_position[i] = uiodev->enc[i].position;
+		uiodev->state->enc_errors[i] = uiodev->enc[i].errors;
 	}
 
-	return 0;
+	state_end(uiodev);
 }
 
 static void clr_int_id(struct uio48_dev *uiodev, int port_number)
 {
 	unsigned base_port = uiodev->base_port;
-    int ret_val;
+    unsigned long flags;
+	u64 start;
 
-	// obtain lock before writing
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	// page and lock register sequences must not interleave with the ISR
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	start = lock_clock();
 
 	// write to specified int_id register
-	outb(0, base_port + 8 + port_number);
+	uio_outb(uiodev, 0, base_port + 8 + port_number);
 
 	//release lock
-	mutex_unlock(&uiodev->mtx);
+	lock_held(&uiodev->page_hold_hist, start);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
 }
 
 static void lock_port(struct uio48_dev *uiodev, int port_number)
 {
 	unsigned base_port = uiodev->base_port;
-    int ret_val;
+    unsigned long flags;
+	u64 start;
 
-	// obtain lock before writing
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	// page and lock register sequences must not interleave with the ISR
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	start = lock_clock();
 
 	// write to specified int_id register
 	uiodev->lock_image |= 1 << port_number;
-	outb(PAGE3 | uiodev->lock_image, base_port + 7);
+	uio_outb(uiodev, PAGE3 | uiodev->lock_image, base_port + 7);
+	publish_images(uiodev);
 
 	//release lock
-	mutex_unlock(&uiodev->mtx);
+	lock_held(&uiodev->page_hold_hist, start);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
 }
 
 static void unlock_port(struct uio48_dev *uiodev, int port_number)
 {
 	unsigned base_port = uiodev->base_port;
-    int ret_val;
+    unsigned long flags;
+	u64 start;
 
-	// obtain lock before writing
-	ret_val = mutex_lock_interruptible(&uiodev->mtx);
+	// page and lock register sequences must not interleave with the ISR
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+	start = lock_clock();
 
 	// write to specified int_id register
 	uiodev->lock_image &= ~(1 << port_number);
-	outb((PAGE3 | uiodev->lock_image), base_port + 7);
+	uio_outb(uiodev, (PAGE3 | uiodev->lock_image), base_port + 7);
+	publish_images(uiodev);
 
 	//release lock
-	mutex_unlock(&uiodev->mtx);
+	lock_held(&uiodev->page_hold_hist, start);
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
 }
+
+#if IS_ENABLED(CONFIG_UIO48_KUNIT_TEST)
+#include "uio48_kunit.c"
+#endif
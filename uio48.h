@@ -14,6 +14,7 @@
 #define __UIO48_H
 
 #include <linux/ioctl.h> 
+#include <linux/types.h>
 
 #define IOCTL_NUM 't'
 
@@ -63,4 +64,378 @@
 /* UNLOCK_PORT function */
 #define	IOCTL_UNLOCK_PORT _IOWR(IOCTL_NUM, 14, int)
 
+/* SET_MODERATION function */
+#define IOCTL_SET_MODERATION _IOW(IOCTL_NUM, 15, struct uio48_moderation)
+
+/* GET_MODERATION function */
+#define IOCTL_GET_MODERATION _IOR(IOCTL_NUM, 16, struct uio48_moderation)
+
+/* WAIT_PATTERN function */
+#define IOCTL_WAIT_PATTERN _IOW(IOCTL_NUM, 17, struct uio48_pattern)
+
+/* PULSE function */
+#define IOCTL_PULSE _IOW(IOCTL_NUM, 18, struct uio48_pulse)
+
+/* SET_PWM function */
+#define IOCTL_SET_PWM _IOW(IOCTL_NUM, 19, struct uio48_pwm)
+
+/* SET_ENCODER function */
+#define IOCTL_SET_ENCODER _IOW(IOCTL_NUM, 20, struct uio48_encoder)
+
+/* GET_ENCODER function */
+#define IOCTL_GET_ENCODER _IOWR(IOCTL_NUM, 21, struct uio48_encoder)
+
+/* CMD_LIST function */
+#define IOCTL_CMD_LIST _IOW(IOCTL_NUM, 22, struct uio48_cmd_list)
+
+/* GET_INFO function */
+#define IOCTL_GET_INFO _IOR(IOCTL_NUM, 23, struct uio48_info)
+
+/* SET_EVENTFD function, the argument is the eventfd or -1 to unregister.
+ * The eventfd counter grows by the number of events queued per wakeup, on
+ * kernels 6.8 and later by one per wakeup. Either way read the events until
+ * none are left rather than relying on the count. */
+#define IOCTL_SET_EVENTFD _IOW(IOCTL_NUM, 24, int)
+
+/* SET_WAIT_MODE function, the argument is UIO48_WAIT_* */
+#define IOCTL_SET_WAIT_MODE _IOW(IOCTL_NUM, 25, int)
+
+/* Event record, as returned by read() on the device node. The timestamp
+ * is CLOCK_MONOTONIC in nanoseconds, taken when the event was latched. */
+struct uio48_event {
+	__u64 timestamp;
+	__u8 bit;		/* 1 based bit number */
+	__u8 chip;		/* 0 based chip index */
+	__u8 flags;		/* UIO48_EVENT_* */
+	__u8 reserved[5];
+};
+
+/* Event flags */
+#define UIO48_EVENT_RISING	0x01	/* input went high */
+#define UIO48_EVENT_FALLING	0x02	/* input went low */
+#define UIO48_EVENT_PULSE	0x04	/* pulse on bit finished */
+
+/* Wait modes. In exclusive mode each queued event wakes only one task
+ * blocked in WAIT_INT or read(), for pools of workers sharing a chip.
+ * poll() and select() waiters are always woken. */
+#define UIO48_WAIT_SHARED	0
+#define UIO48_WAIT_EXCLUSIVE	1
+
+/* Interrupt moderation. A waiter is woken once at least count events are
+ * queued or the oldest queued event is usecs old, whichever comes first.
+ * count = 1 wakes on every event; usecs = 0 disables the deadline. The
+ * ring holds at most 1023 events, larger counts fail with EINVAL. */
+struct uio48_moderation {
+	__u32 count;
+	__u32 usecs;
+};
+
+/* 48 bit input masks, bit 1 is the least significant bit */
+#define UIO48_BIT(n)		(1ULL << ((n) - 1))
+#define UIO48_ALL_BITS		0xffffffffffffULL
+
+/* Sleep until (inputs & mask) == value, or timeout_ms elapses (0 = no
+ * timeout). Bits 1-24 in the mask should have interrupts enabled, as the
+ * pattern is only re-evaluated when an interrupt or sample arrives. */
+struct uio48_pattern {
+	__u64 mask;
+	__u64 value;
+	__u32 timeout_ms;
+	__u32 reserved;
+};
+
+/* One-shot pulse. The bits in mask are driven to polarity (1 = high going
+ * pulse) and returned to the opposite level width_us later. The ioctl
+ * returns at once; UIO48_PULSE_NOTIFY queues an event, tagged with the
+ * lowest pulsed bit, when the pulse ends. */
+struct uio48_pulse {
+	__u64 mask;
+	__u32 width_us;
+	__u8 polarity;
+	__u8 flags;
+	__u8 reserved[2];
+};
+
+#define UIO48_PULSE_NOTIFY	0x01
+
+/* Software PWM on one output bit. The bit is high for duty_us out of every
+ * period_us (100 us to 10 s). period_us = 0 stops the channel and leaves
+ * the bit low. All channels of a device share a single timer. */
+struct uio48_pwm {
+	__u8 bit;
+	__u8 reserved[3];
+	__u32 period_us;
+	__u32 duty_us;
+};
+
+/* Quadrature encoder on two interrupt capable inputs (bits 1-24). The
+ * driver decodes both edges of both inputs in the interrupt handler, four
+ * counts per cycle. Transitions where both inputs changed at once count
+ * as errors. Encoder inputs are not queued as events. SET configures
+ * encoder index and zeroes it (enable = 0 removes it); GET fills in
+ * everything but index. */
+#define UIO48_MAX_ENCODERS	12
+
+struct uio48_encoder {
+	__u8 index;
+	__u8 bit_a;
+	__u8 bit_b;
+	__u8 enable;
+	__u32 errors;
+	__s64 position;
+};
+
+/* Read-only state page, mapped with mmap(NULL, 4096, PROT_READ, MAP_SHARED,
+ * fd, 0). The driver updates it like a seqlock: seq is odd while an update
+ * is in progress, so readers copy it out and retry until seq was even and
+ * unchanged across the copy. input_image holds the last port levels seen
+ * by the interrupt handler (ports 0-2) or the sampler (ports 3-5). */
+struct uio48_state {
+	__u32 seq;
+	__u32 overruns;
+	__u64 input_timestamp;
+	__u8 port_images[6];
+	__u8 lock_image;
+	__u8 reserved0;
+	__u8 enab_image[6];
+	__u8 pol_image[6];
+	__u8 input_image[6];
+	__u8 reserved1[6];
+	__u32 bit_counts[48];
+	__s64 enc_position[UIO48_MAX_ENCODERS];
+	__u32 enc_errors[UIO48_MAX_ENCODERS];
+};
+
+/* Output port images shared with direct port I/O users, mapped with
+ * mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 4096) by a
+ * CAP_SYS_RAWIO process. A writer merges its change into the image word
+ * with a compare-and-swap, then writes the word to the port and repeats
+ * the write while the word no longer equals the value it wrote. The
+ * port_images of the state page only follow writes made by the driver. */
+struct uio48_shadow {
+	__u32 port_images[6];
+	__u32 reserved[2];
+};
+
+struct uio48_info {
+	__u32 base_port;
+	__u32 irq;		/* 0 when the driver polls */
+	__u32 ports;		/* output ports covered by struct uio48_shadow */
+	__u32 reserved;
+};
+
+/* Command lists. IOCTL_CMD_LIST runs up to UIO48_MAX_CMDS commands in
+ * order under one acquisition of the device lock, so lists never
+ * interleave with each other; single bit, port and interrupt ioctls only
+ * take the per-port or page locks and may run between two commands of
+ * a list. Each command's result
+ * (the value read, 0, or a negative errno) is written back into the
+ * array; commands after the first failure get -ECANCELED and the ioctl
+ * fails with the first error. */
+#define UIO48_CMD_VERSION	1
+#define UIO48_MAX_CMDS		256
+#define UIO48_MAX_DELAY_US	100000
+
+#define UIO48_OP_READ_PORT	1	/* port = register offset */
+#define UIO48_OP_WRITE_PORT	2	/* port, value */
+#define UIO48_OP_WRITE_MASKED	3	/* port, mask, value */
+#define UIO48_OP_READ_BIT	4	/* port = 1 based bit */
+#define UIO48_OP_SET_BIT	5	/* port = 1 based bit */
+#define UIO48_OP_CLR_BIT	6	/* port = 1 based bit */
+#define UIO48_OP_ENAB_INT	7	/* port = 1 based bit, value = polarity */
+#define UIO48_OP_DISAB_INT	8	/* port = 1 based bit */
+#define UIO48_OP_LOCK_PORT	9	/* port */
+#define UIO48_OP_UNLOCK_PORT	10	/* port */
+#define UIO48_OP_DELAY		11	/* arg = usecs */
+
+struct uio48_cmd {
+	__u8 op;
+	__u8 port;
+	__u8 mask;
+	__u8 value;
+	__u32 arg;
+	__s32 result;
+	__u32 reserved;
+};
+
+struct uio48_cmd_list {
+	__u32 version;		/* UIO48_CMD_VERSION */
+	__u32 count;
+	__u64 cmds;		/* user pointer to count commands */
+};
+
+/* io_uring commands (IORING_OP_URING_CMD, kernel 6.3 and later). Set
+ * sqe->cmd_op to one of these and put the argument in the command area
+ * of the SQE; cqe->res is the result or a negative errno.
+ * UIO48_URING_CMD runs one struct uio48_cmd (UIO48_OP_DELAY excepted) and
+ * returns its result. UIO48_URING_WAIT completes when a blocking read()
+ * would return, copying up to max_events records to events; res is the
+ * number copied. Waits need kernel 6.7 and fail with -EOPNOTSUPP before. */
+#define UIO48_URING_CMD _IOWR(IOCTL_NUM, 26, struct uio48_cmd)
+#define UIO48_URING_WAIT _IOWR(IOCTL_NUM, 27, struct uio48_uring_wait)
+
+struct uio48_uring_wait {
+	__u64 events;		/* user pointer to max_events records */
+	__u32 max_events;
+	__u32 reserved;
+};
+
+#ifndef __KERNEL__
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Register backends of the user library. The backend is chosen when the
+ * first chip is opened: the one passed to uio48_set_backend() before that,
+ * else UIO48_BACKEND from the environment ("kernel", "direct" or "sim"),
+ * else the kernel driver. "sim" needs uio48sim.o and -lpthread on the link
+ * line, without them it falls back to the kernel driver. Handles returned
+ * by open() must be > 0. */
+struct uio48_backend {
+	const char *name;
+	int direct;		/* direct port I/O on top, see uio48io.c */
+	int (*open)(int chip);	/* 0 based chip index */
+	int (*close)(int handle);
+	int (*ioctl)(int handle, unsigned long request, unsigned long arg);
+	ssize_t (*read)(int handle, void *buf, size_t len);
+	void *(*mmap)(int handle, size_t len, int prot, off_t offset);
+	int (*munmap)(void *addr, size_t len);
+};
+
+extern const struct uio48_backend uio48_kernel_backend;
+extern const struct uio48_backend uio48_direct_backend;
+extern const struct uio48_backend uio48_sim_backend;
+
+int uio48_set_backend(const struct uio48_backend *be);
+
+/* Simulator stimulus (uio48sim.c) */
+struct uio48_wave_step {
+	unsigned long long delay_ns;	/* after the previous step */
+	unsigned long long mask;	/* inputs to drive, UIO48_BIT() */
+	unsigned long long value;
+};
+
+int uio48sim_set_inputs(int chip_number, unsigned long long mask,
+			unsigned long long value);
+unsigned long long uio48sim_get_outputs(int chip_number);
+int uio48sim_play(int chip_number, const struct uio48_wave_step *steps,
+		  int count, int loops);
+int uio48sim_stop(int chip_number);
+int uio48sim_wait(int chip_number);
+int uio48sim_replay(const char *path, double speed, int loops);
+
+/* Trace files, written by uio48-record and replayed by uio48sim_replay().
+ * A struct uio48_trace_header followed by fixed size records, so a trace
+ * can be mapped and indexed directly. Snapshots are written when taken and
+ * events when read, so a snapshot can precede events latched before it:
+ * sort a chip's records by timestamp before relying on their order, as
+ * uio48sim_replay() does. */
+#define UIO48_TRACE_MAGIC	0x54383455	/* "U48T" */
+#define UIO48_TRACE_VERSION	1
+
+#define UIO48_TRACE_EVENT	1	/* an event read from the chip */
+#define UIO48_TRACE_SNAPSHOT	2	/* the levels of all 48 pins */
+
+struct uio48_trace_header {
+	__u32 magic;
+	__u32 version;
+	__u32 record_size;	/* sizeof(struct uio48_trace_record) */
+	__u32 chips;		/* bit n set if chip n+1 was recorded */
+	__u64 start_ns;		/* CLOCK_MONOTONIC when recording began */
+	__u64 reserved[2];
+};
+
+struct uio48_trace_record {
+	__u64 timestamp;	/* CLOCK_MONOTONIC ns */
+	__u8 type;		/* UIO48_TRACE_* */
+	__u8 chip;		/* 0 based chip index */
+	__u8 bit;		/* events: 1 based bit number */
+	__u8 flags;		/* events: UIO48_EVENT_* */
+	__u8 ports[6];		/* snapshots: pin levels of ports 0-5 */
+	__u8 reserved[6];
+};
+
+/* User library (uio48io.c) command list builder */
+struct uio48_batch {
+	int chip_number;
+	int count;
+	struct uio48_cmd cmds[UIO48_MAX_CMDS];
+};
+
+void batch_init(struct uio48_batch *batch, int chip_number);
+int batch_add(struct uio48_batch *batch, int op, int port, int mask, int value,
+			  unsigned arg);
+int batch_read_port(struct uio48_batch *batch, int port_number);
+int batch_write_port(struct uio48_batch *batch, int port_number, int val);
+int batch_write_masked(struct uio48_batch *batch, int port_number, int mask,
+					   int val);
+int batch_read_bit(struct uio48_batch *batch, int bit_number);
+int batch_set_bit(struct uio48_batch *batch, int bit_number);
+int batch_clr_bit(struct uio48_batch *batch, int bit_number);
+int batch_enab_int(struct uio48_batch *batch, int bit_number, int polarity);
+int batch_disab_int(struct uio48_batch *batch, int bit_number);
+int batch_lock_port(struct uio48_batch *batch, int port_number);
+int batch_unlock_port(struct uio48_batch *batch, int port_number);
+int batch_delay(struct uio48_batch *batch, unsigned usecs);
+int batch_submit(struct uio48_batch *batch);
+
+/* Output transactions, per chip and per thread */
+int begin_transaction(int chip_number);
+int commit_transaction(int chip_number);
+int abort_transaction(int chip_number);
+
+/* Context API. Each context has its own descriptor and state mapping,
+ * so threads using separate contexts share no library state. */
+struct uio48_ctx;
+
+struct uio48_ctx *uio48_open(int chip_number);
+void uio48_close(struct uio48_ctx *ctx);
+int uio48_read_bit(struct uio48_ctx *ctx, int bit_number);
+int uio48_write_bit(struct uio48_ctx *ctx, int bit_number, int val);
+int uio48_set_bit(struct uio48_ctx *ctx, int bit_number);
+int uio48_clr_bit(struct uio48_ctx *ctx, int bit_number);
+int uio48_read_byte(struct uio48_ctx *ctx, int port_number);
+int uio48_write_byte(struct uio48_ctx *ctx, int port_number, int val);
+int uio48_enab_int(struct uio48_ctx *ctx, int bit_number, int polarity);
+int uio48_disab_int(struct uio48_ctx *ctx, int bit_number);
+int uio48_clr_int(struct uio48_ctx *ctx, int bit_number);
+int uio48_get_int(struct uio48_ctx *ctx);
+int uio48_wait_int(struct uio48_ctx *ctx);
+int uio48_read_events(struct uio48_ctx *ctx, struct uio48_event *events,
+					  int max_events);
+int uio48_submit(struct uio48_ctx *ctx, struct uio48_batch *batch);
+int uio48_read_state(struct uio48_ctx *ctx, struct uio48_state *state);
+
+/* Event dispatcher (uio48dispatch.c). Handlers registered per chip, bit
+ * and edge run on a pool of worker threads. Each bit's events are handled
+ * in order, one at a time; different bits are handled in parallel, so
+ * handlers sharing data must lock it. 0 fields of the config select the
+ * defaults. Programs using it link uio48dispatch.o and -lpthread. */
+typedef void (*uio48_handler)(const struct uio48_event *event, void *arg);
+
+struct uio48_dispatch_config {
+	int workers;		/* worker threads, default one per CPU */
+	int queue_size;		/* events buffered per bit, default 1024 */
+	int batch;		/* events per read and per handler run, default 64 */
+};
+
+struct uio48_dispatcher;
+
+struct uio48_dispatcher *uio48_dispatch_create(const struct uio48_dispatch_config *cfg);
+int uio48_dispatch_register(struct uio48_dispatcher *d, int chip_number,
+							int bit_number, int edges, uio48_handler fn,
+							void *arg);
+int uio48_dispatch_start(struct uio48_dispatcher *d);
+void uio48_dispatch_stop(struct uio48_dispatcher *d);
+unsigned long long uio48_dispatch_dropped(struct uio48_dispatcher *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KERNEL__ */
+
 #endif /* __UIO48_H */
@@ -0,0 +1,693 @@
+//*****************************************************************************
+//
+//	Copyright 2011 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+//*****************************************************************************
+//
+//	Name	 : uio48.hpp
+//
+//	Project	 : UIO48 Linux Device Driver
+//
+//	Header-only C++20 coroutine interface to the driver. An io_context
+//	runs any number of coroutines on the calling thread, waiting in a
+//	single epoll_wait() on the device nodes, which are opened non-blocking.
+//	A suspended wait costs one list node in the coroutine frame, no thread
+//	or stack:
+//
+//		uio48::task<> watch(uio48::device &dev)
+//		{
+//			for(;;)
+//			{
+//				uio48_event ev = co_await dev.edge(3);
+//				co_await dev.pulse(9, std::chrono::microseconds(500));
+//			}
+//		}
+//
+//		uio48::io_context io;
+//		uio48::device dev(io, 1);
+//		dev.enable(3, 1);
+//		io.spawn(watch(dev));
+//		io.run();
+//
+//	A context and its devices belong to the thread calling run(). Waiters
+//	are resumed from inside run() in the order their events were read, so
+//	a coroutine that waits again at once sees every later event. Events
+//	nobody waits for are discarded. This talks to the kernel driver
+//	directly; the simulated and direct I/O backends of uio48io.c are not
+//	used. Failed system calls throw std::system_error.
+//
+//*****************************************************************************
+
+#ifndef __UIO48_HPP
+#define __UIO48_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <map>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+#include "uio48.h"
+
+namespace uio48 {
+
+using clock = std::chrono::steady_clock;	// CLOCK_MONOTONIC, as event timestamps
+
+class io_context;
+class device;
+
+template<typename T = void> class task;
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+// A suspended coroutine, linked on the list of what it waits for
+struct waiter {
+	waiter *prev = nullptr;
+	waiter *next = nullptr;
+	std::coroutine_handle<> handle;
+
+	// A coroutine destroyed while it waits leaves the list
+	~waiter() { unlink(); }
+
+	void unlink()
+	{
+		if(next)
+		{
+			prev->next = next;
+			next->prev = prev;
+			prev = next = nullptr;
+		}
+	}
+};
+
+struct waiter_list {
+	waiter head;
+
+	waiter_list() { head.prev = head.next = &head; }
+	waiter_list(const waiter_list &) = delete;
+	waiter_list &operator=(const waiter_list &) = delete;
+
+	bool empty() const { return head.next == &head; }
+	waiter *front() const { return head.next; }
+	waiter *end() { return &head; }
+
+	void push(waiter *w)
+	{
+		w->next = &head;
+		w->prev = head.prev;
+		head.prev->next = w;
+		head.prev = w;
+	}
+};
+
+// A deadline on the io_context timer queue
+struct timer {
+	std::multimap<clock::time_point, timer *>::iterator pos;
+	bool armed = false;
+
+	virtual void expired() = 0;
+
+protected:
+	~timer() = default;
+};
+
+// Something registered with the io_context epoll descriptor
+struct io_object {
+	virtual void ready(std::uint32_t events) = 0;
+
+protected:
+	~io_object() = default;
+};
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+	io_context *owner = nullptr;		// set by io_context::spawn()
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+// Continue the awaiting coroutine, or retire a spawned task
+struct final_awaiter {
+	bool await_ready() noexcept { return false; }
+	void await_resume() noexcept {}
+
+	template<typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+	{
+		auto &p = h.promise();
+
+		if(p.owner)
+		{
+			auto *owner = p.owner;
+			std::exception_ptr error = p.error;
+
+			h.destroy();
+			owner->task_done(error);
+
+			return std::noop_coroutine();
+		}
+
+		return p.continuation ? p.continuation : std::noop_coroutine();
+	}
+};
+
+template<typename T>
+struct promise_value : promise_base {
+	std::optional<T> value;
+
+	void return_value(T v) { value.emplace(std::move(v)); }
+
+	T result()
+	{
+		if(error)
+			std::rethrow_exception(error);
+
+		return std::move(*value);
+	}
+};
+
+template<>
+struct promise_value<void> : promise_base {
+	void return_void() noexcept {}
+
+	void result()
+	{
+		if(error)
+			std::rethrow_exception(error);
+	}
+};
+
+} // namespace detail
+
+// A lazily started coroutine. co_await it from another coroutine, or
+// hand a task<> to io_context::spawn().
+template<typename T>
+class task {
+public:
+	struct promise_type : detail::promise_value<T> {
+		task get_return_object()
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		detail::final_awaiter final_suspend() noexcept { return {}; }
+	};
+
+	task(task &&t) noexcept : h(std::exchange(t.h, nullptr)) {}
+	task(const task &) = delete;
+
+	task &operator=(task t) noexcept
+	{
+		std::swap(h, t.h);
+		return *this;
+	}
+
+	~task()
+	{
+		if(h)
+			h.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h.promise().continuation = c;
+		return h;
+	}
+
+	T await_resume() { return h.promise().result(); }
+
+private:
+	friend class io_context;
+
+	explicit task(std::coroutine_handle<promise_type> h) : h(h) {}
+
+	std::coroutine_handle<promise_type> h;
+};
+
+class io_context {
+public:
+	io_context() : epfd(epoll_create1(EPOLL_CLOEXEC))
+	{
+		if(epfd < 0)
+			detail::throw_errno("epoll_create1");
+	}
+
+	io_context(const io_context &) = delete;
+	io_context &operator=(const io_context &) = delete;
+
+	~io_context() { ::close(epfd); }
+
+	// Start a coroutine on the next pass of run(). The context owns it
+	// from now on and frees it when it returns.
+	void spawn(task<void> t)
+	{
+		auto h = std::exchange(t.h, nullptr);
+
+		h.promise().owner = this;
+		tasks++;
+		ready.push_back(h);
+	}
+
+	// Run until every spawned task has returned or stop() is called.
+	// An exception escaping a spawned task is rethrown from here.
+	void run()
+	{
+		epoll_event evs[16];
+		int n, x, timeout;
+
+		stopped = false;
+
+		while(!stopped && tasks)
+		{
+			while(!ready.empty() && !error)
+			{
+				auto h = ready.front();
+
+				ready.pop_front();
+				h.resume();
+			}
+
+			if(error)
+				std::rethrow_exception(std::exchange(error, nullptr));
+
+			if(stopped || !tasks)
+				break;
+
+			timeout = -1;
+
+			if(!timers.empty())
+			{
+				auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+					timers.begin()->first - clock::now());
+
+				timeout = wait.count() > 0 ? (int)wait.count() : 0;
+			}
+
+			n = epoll_wait(epfd, evs, 16, timeout);
+
+			if(n < 0 && errno != EINTR)
+				detail::throw_errno("epoll_wait");
+
+			for(x = 0; x < n; x++)
+				static_cast<detail::io_object *>(evs[x].data.ptr)->ready(evs[x].events);
+
+			while(!timers.empty() && timers.begin()->first <= clock::now())
+			{
+				detail::timer *t = timers.begin()->second;
+
+				timers.erase(timers.begin());
+				t->armed = false;
+				t->expired();
+			}
+		}
+
+		if(error)
+			std::rethrow_exception(std::exchange(error, nullptr));
+	}
+
+	// Make run() return after the coroutine running now suspends
+	void stop() { stopped = true; }
+
+	struct sleep_awaiter : detail::timer {
+		io_context &io;
+		clock::time_point when;
+		std::coroutine_handle<> handle;
+
+		sleep_awaiter(io_context &io, clock::time_point when) : io(io), when(when) {}
+		~sleep_awaiter() { io.cancel_timer(this); }
+
+		bool await_ready() const { return when <= clock::now(); }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			io.add_timer(this, when);
+		}
+
+		void await_resume() const noexcept {}
+
+		void expired() override { handle.resume(); }
+	};
+
+	sleep_awaiter sleep_until(clock::time_point when) { return sleep_awaiter(*this, when); }
+	sleep_awaiter sleep_for(clock::duration d) { return sleep_awaiter(*this, clock::now() + d); }
+
+private:
+	friend class device;
+	friend struct detail::final_awaiter;
+
+	void task_done(std::exception_ptr e)
+	{
+		tasks--;
+
+		if(e && !error)
+			error = e;
+	}
+
+	void add_timer(detail::timer *t, clock::time_point when)
+	{
+		t->pos = timers.emplace(when, t);
+		t->armed = true;
+	}
+
+	void cancel_timer(detail::timer *t)
+	{
+		if(t->armed)
+		{
+			timers.erase(t->pos);
+			t->armed = false;
+		}
+	}
+
+	void watch(int fd, detail::io_object *obj)
+	{
+		epoll_event ev = {};
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = obj;
+
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			detail::throw_errno("epoll_ctl");
+	}
+
+	void unwatch(int fd) { epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr); }
+
+	int epfd;
+	std::multimap<clock::time_point, detail::timer *> timers;
+	std::deque<std::coroutine_handle<>> ready;
+	std::size_t tasks = 0;
+	bool stopped = false;
+	std::exception_ptr error;
+};
+
+// One chip, opened non-blocking and watched by an io_context. The device
+// must outlive the coroutines waiting on it.
+class device : private detail::io_object {
+public:
+	// chip_number is 1 based, as in the C library
+	device(io_context &io, int chip_number)
+		: device(io, (std::string("/dev/uio48") + char('a' + chip_number - 1)).c_str())
+	{
+	}
+
+	device(io_context &io, const char *path) : io(io)
+	{
+		fd = ::open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+		if(fd < 0)
+			detail::throw_errno(path);
+
+		try
+		{
+			io.watch(fd, this);
+		}
+		catch(...)
+		{
+			::close(fd);
+			throw;
+		}
+	}
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	~device()
+	{
+		io.unwatch(fd);
+		::close(fd);
+	}
+
+	int native_handle() const { return fd; }
+
+	// Interrupt control and plain bit I/O, as in the C library
+	void enable(int bit_number, int polarity) { call(IOCTL_ENAB_INT, bit_number << 8 | polarity); }
+	void disable(int bit_number) { call(IOCTL_DISAB_INT, bit_number); }
+	int read_bit(int bit_number) { return call(IOCTL_READ_BIT, bit_number); }
+	void write_bit(int bit_number, int val) { call(IOCTL_WRITE_BIT, bit_number << 8 | val); }
+
+	struct edge_awaiter : detail::waiter {
+		device &dev;
+		int bit;
+		int flags;				// UIO48_EVENT_* to wait for
+		uio48_event event = {};
+
+		edge_awaiter(device &dev, int bit, int flags) : dev(dev), bit(bit), flags(flags) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			dev.bits[bit].push(this);
+		}
+
+		uio48_event await_resume() const noexcept { return event; }
+	};
+
+	// The next event of an interrupt enabled bit (1-48)
+	edge_awaiter edge(int bit_number, int flags = UIO48_EVENT_RISING | UIO48_EVENT_FALLING)
+	{
+		check_bit(bit_number);
+
+		return edge_awaiter(*this, bit_number, flags);
+	}
+
+	// Drive a bit to polarity and back after width, through IOCTL_PULSE.
+	// The pulse starts now; the result, the driver's end of pulse event,
+	// must be awaited at once.
+	edge_awaiter pulse(int bit_number, std::chrono::microseconds width, int polarity = 1)
+	{
+		struct uio48_pulse req = {};
+
+		check_bit(bit_number);
+
+		req.mask = UIO48_BIT(bit_number);
+		req.width_us = width.count();
+		req.polarity = polarity;
+		req.flags = UIO48_PULSE_NOTIFY;
+
+		if(ioctl(fd, IOCTL_PULSE, &req) < 0)
+			detail::throw_errno("IOCTL_PULSE");
+
+		return edge_awaiter(*this, bit_number, UIO48_EVENT_PULSE);
+	}
+
+	struct pattern_awaiter : detail::waiter, detail::timer {
+		device &dev;
+		std::uint64_t mask;
+		std::uint64_t value;
+		std::chrono::milliseconds timeout;
+		bool matched = false;
+
+		pattern_awaiter(device &dev, std::uint64_t mask, std::uint64_t value,
+						std::chrono::milliseconds timeout)
+			: dev(dev), mask(mask & UIO48_ALL_BITS), value(value & mask & UIO48_ALL_BITS),
+			  timeout(timeout)
+		{
+		}
+
+		~pattern_awaiter() { dev.io.cancel_timer(this); }
+
+		bool await_ready()
+		{
+			matched = (dev.read_inputs(mask) & mask) == value;
+			return matched;
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			dev.patterns.push(this);
+
+			if(timeout.count() > 0)
+				dev.io.add_timer(this, clock::now() + timeout);
+		}
+
+		// true if the pattern was seen, false on timeout
+		bool await_resume() const noexcept { return matched; }
+
+		void expired() override
+		{
+			unlink();
+			handle.resume();
+		}
+	};
+
+	// Wait until (inputs & mask) == value, or timeout (0 = none). As with
+	// IOCTL_WAIT_PATTERN, the bits in mask should have interrupts enabled:
+	// the inputs are only read again when events arrive.
+	pattern_awaiter pattern(std::uint64_t mask, std::uint64_t value,
+							std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+	{
+		return pattern_awaiter(*this, mask, value, timeout);
+	}
+
+private:
+	int call(unsigned long request, unsigned long arg)
+	{
+		int ret = ioctl(fd, request, arg);
+
+		if(ret < 0)
+			detail::throw_errno("uio48 ioctl");
+
+		return ret;
+	}
+
+	static void check_bit(int bit_number)
+	{
+		if(bit_number < 1 || bit_number > 48)
+			throw std::system_error(EINVAL, std::generic_category(), "uio48 bit number");
+	}
+
+	std::uint64_t read_inputs(std::uint64_t mask)
+	{
+		std::uint64_t state = 0;
+		int port;
+
+		for(port = 0; port < 6; port++)
+			if((mask >> (port * 8)) & 0xff)
+				state |= (std::uint64_t)call(IOCTL_READ_PORT, port) << (port * 8);
+
+		return state;
+	}
+
+	// Resume the waiters of the event's bit that match its flags
+	void deliver(const uio48_event &ev)
+	{
+		detail::waiter_list matched;
+		detail::waiter *w, *next;
+
+		if(ev.bit < 1 || ev.bit > 48)
+			return;
+
+		// Move them off first, a resumed waiter may queue itself again
+		for(w = bits[ev.bit].front(); w != bits[ev.bit].end(); w = next)
+		{
+			next = w->next;
+
+			if(static_cast<edge_awaiter *>(w)->flags & ev.flags)
+			{
+				w->unlink();
+				static_cast<edge_awaiter *>(w)->event = ev;
+				matched.push(w);
+			}
+		}
+
+		resume_all(matched);
+	}
+
+	void check_patterns()
+	{
+		detail::waiter_list matched;
+		detail::waiter *w, *next;
+		std::uint64_t mask = 0, state;
+
+		for(w = patterns.front(); w != patterns.end(); w = w->next)
+			mask |= static_cast<pattern_awaiter *>(w)->mask;
+
+		state = read_inputs(mask);
+
+		for(w = patterns.front(); w != patterns.end(); w = next)
+		{
+			auto *p = static_cast<pattern_awaiter *>(w);
+
+			next = w->next;
+
+			if((state & p->mask) == p->value)
+			{
+				w->unlink();
+				io.cancel_timer(p);
+				p->matched = true;
+				matched.push(w);
+			}
+		}
+
+		resume_all(matched);
+	}
+
+	static void resume_all(detail::waiter_list &list)
+	{
+		detail::waiter *w;
+
+		while(!list.empty())
+		{
+			w = list.front();
+			w->unlink();
+			w->handle.resume();
+		}
+	}
+
+	// Drain the queued events
+	void ready(std::uint32_t) override
+	{
+		uio48_event evs[64];
+		ssize_t n;
+		int x;
+
+		for(;;)
+		{
+			n = ::read(fd, evs, sizeof(evs));
+
+			if(n < 0)
+			{
+				if(errno == EINTR)
+					continue;
+
+				if(errno == EAGAIN)
+					break;
+
+				detail::throw_errno("uio48 read");
+			}
+
+			for(x = 0; x < n / (ssize_t)sizeof(evs[0]); x++)
+				deliver(evs[x]);
+
+			if(!patterns.empty())
+				check_patterns();
+
+			if(n < (ssize_t)sizeof(evs))
+				break;
+		}
+	}
+
+	io_context &io;
+	int fd;
+	detail::waiter_list bits[49];		// edge and pulse waiters by bit
+	detail::waiter_list patterns;
+};
+
+} // namespace uio48
+
+#endif /* __UIO48_HPP */
@@ -0,0 +1,396 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests for the uio48 driver
+ *
+ * Included at the end of uio48.c when CONFIG_UIO48_KUNIT_TEST is set, so
+ * the tests reach its static functions. Every case runs on a private fake
+ * device, never on the ones the module registered. Build and run with
+ *	make CONFIG_UIO48_KUNIT_TEST=y
+ *	insmod uio48.ko fake=Y
+ * against a kernel with CONFIG_KUNIT; the module needs one device to load.
+ * Results go to the kernel log and /sys/kernel/debug/kunit/uio48/results.
+ * The bench cases report the same numbers as the debugfs bench file.
+ */
+
+#include <kunit/test.h>
+
+#if !IS_ENABLED(CONFIG_KUNIT)
+#error "CONFIG_UIO48_KUNIT_TEST needs a kernel built with CONFIG_KUNIT"
+#endif
+
+// Register writes are logged so the paging sequences can be checked
+#define KUNIT_LOG_SIZE	32
+
+#define KUNIT_BENCH	100000
+
+struct uio48_kunit_write {
+	unsigned reg;		// offset from the base port
+	u8 val;
+};
+
+struct uio48_kunit {
+	struct uio48_dev dev;
+	struct uio48_kunit_write log[KUNIT_LOG_SIZE];
+	int logged;
+};
+
+static void kunit_outb(struct uio48_dev *uiodev, u8 val, unsigned port)
+{
+	struct uio48_kunit *k = container_of(uiodev, struct uio48_kunit, dev);
+
+	if (k->logged < KUNIT_LOG_SIZE) {
+		k->log[k->logged].reg = port - uiodev->base_port;
+		k->log[k->logged].val = val;
+		k->logged++;
+	}
+
+	fake_outb(uiodev, val, port);
+}
+
+static const struct uio48_io_ops kunit_io_ops = {
+	.inb = fake_inb,
+	.outb = kunit_outb,
+};
+
+// A fake device set up as init_module() does, without a poll timer
+static int uio48_kunit_init(struct kunit *test)
+{
+	struct uio48_kunit *k;
+	struct uio48_dev *uiodev;
+
+	k = kunit_kzalloc(test, sizeof(*k), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, k);
+
+	uiodev = &k->dev;
+	init_dev(uiodev, 0);
+
+	uiodev->state = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, uiodev->state);
+	uiodev->shadow = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, uiodev->shadow);
+	uiodev->fake = kunit_kzalloc(test, sizeof(*uiodev->fake), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, uiodev->fake);
+
+	spin_lock_init(&uiodev->fake->lock);
+	uiodev->fake->page_lock = PAGE3;
+	uiodev->io = &kunit_io_ops;
+
+	init_io(uiodev, FAKE_BASE);
+	k->logged = 0;
+
+	test->priv = k;
+
+	return 0;
+}
+
+static void uio48_kunit_exit(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+	int i;
+
+	hrtimer_cancel(&uiodev->pwm_timer);
+
+	for (i = 0; i < MAX_PULSES; i++)
+		hrtimer_cancel(&uiodev->pulses[i].timer);
+
+	hrtimer_cancel(&uiodev->cos_timer);
+	hrtimer_cancel(&uiodev->mod_timer);
+}
+
+// Run the handler the way the interrupt or the poll timer does
+static void kunit_irq(struct uio48_dev *uiodev)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	irq_handler(0, uiodev);
+	local_irq_restore(flags);
+}
+
+// Queue n rising events stamped first, first + 1, ...
+static void kunit_queue(struct uio48_dev *uiodev, u64 first, int n)
+{
+	unsigned long flags;
+	int i;
+
+	uio48_spnlck_lock_irqsave(uiodev, flags);
+
+	for (i = 0; i < n; i++)
+		queue_event(uiodev, (i % 48) + 1, first + i, UIO48_EVENT_RISING);
+
+	moderate(uiodev);
+
+	uio48_spnlck_unlock_irqrestore(uiodev, flags);
+}
+
+static void kunit_expect_writes(struct kunit *test, struct uio48_kunit *k,
+				const struct uio48_kunit_write *seq, int n)
+{
+	int i;
+
+	KUNIT_ASSERT_EQ(test, k->logged, n);
+
+	for (i = 0; i < n; i++) {
+		KUNIT_EXPECT_EQ_MSG(test, k->log[i].reg, seq[i].reg, "write %d", i);
+		KUNIT_EXPECT_EQ_MSG(test, k->log[i].val, seq[i].val, "write %d", i);
+	}
+
+	k->logged = 0;
+}
+
+// The ISR latches an event per enabled edge, tagged with its polarity
+static void uio48_test_isr_latch(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+	struct uio48_fake *f = uiodev->fake;
+	struct uio48_event ev[4];
+
+	enab_int(uiodev, 3, 1);
+	enab_int(uiodev, 10, 0);
+
+	kunit_irq(uiodev);
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, ev, 4), 0);
+
+	// bit 3 rises with it, bit 10 waits for its falling edge
+	fake_drive(f, UIO48_BIT(3) | UIO48_BIT(10), UIO48_BIT(3) | UIO48_BIT(10));
+	KUNIT_EXPECT_EQ(test, f->int_id[0], 0x04);
+	KUNIT_EXPECT_EQ(test, f->int_id[1], 0);
+
+	kunit_irq(uiodev);
+	KUNIT_ASSERT_EQ(test, get_events(uiodev, ev, 4), 1);
+	KUNIT_EXPECT_EQ(test, ev[0].bit, 3);
+	KUNIT_EXPECT_EQ(test, ev[0].chip, 0);
+	KUNIT_EXPECT_EQ(test, ev[0].flags, UIO48_EVENT_RISING);
+	KUNIT_EXPECT_NE(test, ev[0].timestamp, 0);
+
+	// the handler clears what it latched and keeps the input image
+	KUNIT_EXPECT_EQ(test, f->int_id[0], 0);
+	KUNIT_EXPECT_EQ(test, uiodev->input_image[0], 0x04);
+
+	fake_drive(f, UIO48_BIT(3) | UIO48_BIT(10), 0);
+
+	kunit_irq(uiodev);
+	KUNIT_ASSERT_EQ(test, get_events(uiodev, ev, 4), 1);
+	KUNIT_EXPECT_EQ(test, ev[0].bit, 10);
+	KUNIT_EXPECT_EQ(test, ev[0].flags, UIO48_EVENT_FALLING);
+
+	KUNIT_EXPECT_EQ(test, uiodev->state->bit_counts[2], 1);
+	KUNIT_EXPECT_EQ(test, uiodev->state->bit_counts[9], 1);
+	KUNIT_EXPECT_EQ(test, uiodev->overruns, 0);
+}
+
+// Events come out in order across the end of the ring, and a full ring
+// drops the oldest
+static void uio48_test_ring_wrap(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+	struct uio48_event *evs;
+	int i;
+
+	evs = kunit_kmalloc_array(test, MAX_INTS, sizeof(*evs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, evs);
+
+	// move the pointers close to the end
+	kunit_queue(uiodev, 0, MAX_INTS - 10);
+	KUNIT_ASSERT_EQ(test, get_events(uiodev, evs, MAX_INTS), MAX_INTS - 10);
+
+	kunit_queue(uiodev, 1000, MAX_INTS - 1);
+	KUNIT_EXPECT_LT(test, uiodev->ring.inptr, uiodev->ring.outptr);
+	KUNIT_EXPECT_EQ(test, uiodev->overruns, 0);
+
+	KUNIT_ASSERT_EQ(test, get_events(uiodev, evs, MAX_INTS), MAX_INTS - 1);
+	for (i = 0; i < MAX_INTS - 1; i++)
+		KUNIT_EXPECT_EQ_MSG(test, evs[i].timestamp, 1000 + i, "event %d", i);
+
+	// 100 more than fit
+	kunit_queue(uiodev, 0, MAX_INTS - 1 + 100);
+	KUNIT_EXPECT_EQ(test, uiodev->overruns, 100);
+	KUNIT_EXPECT_EQ(test, uiodev->state->overruns, 100);
+
+	KUNIT_ASSERT_EQ(test, get_events(uiodev, evs, MAX_INTS), MAX_INTS - 1);
+	KUNIT_EXPECT_EQ(test, evs[0].timestamp, 100);
+	KUNIT_EXPECT_EQ(test, evs[MAX_INTS - 2].timestamp, MAX_INTS - 1 + 99);
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, evs, MAX_INTS), 0);
+}
+
+// Waiters are due at the count threshold or once the oldest event is old
+// enough, and the deadline timer covers the gap
+static void uio48_test_moderation(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+	struct uio48_event evs[8];
+
+	uiodev->mod_count = 4;
+	uiodev->mod_usecs = 0;
+
+	kunit_queue(uiodev, ktime_get_ns(), 3);
+	KUNIT_EXPECT_FALSE(test, events_due(uiodev));
+	KUNIT_EXPECT_FALSE(test, hrtimer_is_queued(&uiodev->mod_timer));
+
+	kunit_queue(uiodev, ktime_get_ns(), 1);
+	KUNIT_EXPECT_TRUE(test, events_due(uiodev));
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, evs, 8), 4);
+
+	// a second is plenty for the test to get from one line to the next
+	uiodev->mod_usecs = USEC_PER_SEC;
+
+	kunit_queue(uiodev, ktime_get_ns(), 1);
+	KUNIT_EXPECT_FALSE(test, events_due(uiodev));
+	KUNIT_EXPECT_TRUE(test, hrtimer_is_queued(&uiodev->mod_timer));
+
+	// reaching the count cancels the deadline
+	kunit_queue(uiodev, ktime_get_ns(), 3);
+	KUNIT_EXPECT_TRUE(test, events_due(uiodev));
+	KUNIT_EXPECT_FALSE(test, hrtimer_is_queued(&uiodev->mod_timer));
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, evs, 8), 4);
+
+	kunit_queue(uiodev, ktime_get_ns() - 2 * NSEC_PER_SEC, 1);
+	KUNIT_EXPECT_TRUE(test, events_due(uiodev));
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, evs, 8), 1);
+
+	KUNIT_EXPECT_FALSE(test, events_due(uiodev));
+}
+
+// enab_int, clr_int and disab_int page through the same registers and
+// leave page 3 and the port locks as they found them
+static void uio48_test_page_sequences(struct kunit *test)
+{
+	struct uio48_kunit *k = test->priv;
+	struct uio48_dev *uiodev = &k->dev;
+	struct uio48_fake *f = uiodev->fake;
+	static const struct uio48_kunit_write enab_seq[] = {
+		{ 7, PAGE2 | 0x20 }, { 9, 0x08 },
+		{ 7, PAGE1 | 0x20 }, { 9, 0x08 },
+		{ 7, PAGE3 | 0x20 },
+	};
+	static const struct uio48_kunit_write clr_seq[] = {
+		{ 7, PAGE2 | 0x20 }, { 9, 0x00 }, { 9, 0x08 },
+		{ 7, PAGE3 | 0x20 },
+	};
+	static const struct uio48_kunit_write disab_seq[] = {
+		{ 7, PAGE2 | 0x20 }, { 9, 0x00 },
+		{ 7, PAGE3 | 0x20 },
+	};
+
+	lock_port(uiodev, 5);
+	k->logged = 0;
+
+	enab_int(uiodev, 12, 1);
+	kunit_expect_writes(test, k, enab_seq, ARRAY_SIZE(enab_seq));
+	KUNIT_EXPECT_EQ(test, f->enab[1], 0x08);
+	KUNIT_EXPECT_EQ(test, f->pol[1], 0x08);
+	KUNIT_EXPECT_EQ(test, uiodev->enab_image[1], 0x08);
+	KUNIT_EXPECT_EQ(test, uiodev->pol_image[1], 0x08);
+	KUNIT_EXPECT_EQ(test, uiodev->state->enab_image[1], 0x08);
+
+	fake_drive(f, UIO48_BIT(12), UIO48_BIT(12));
+	KUNIT_EXPECT_EQ(test, f->int_id[1], 0x08);
+	k->logged = 0;
+
+	clr_int(uiodev, 12);
+	kunit_expect_writes(test, k, clr_seq, ARRAY_SIZE(clr_seq));
+	KUNIT_EXPECT_EQ(test, f->int_id[1], 0);
+	KUNIT_EXPECT_EQ(test, f->enab[1], 0x08);
+
+	disab_int(uiodev, 12);
+	kunit_expect_writes(test, k, disab_seq, ARRAY_SIZE(disab_seq));
+	KUNIT_EXPECT_EQ(test, f->enab[1], 0);
+	KUNIT_EXPECT_EQ(test, uiodev->enab_image[1], 0);
+
+	KUNIT_EXPECT_EQ(test, f->page_lock, PAGE3 | 0x20);
+}
+
+// Bit numbers outside 1-48 are refused before a register or an image is
+// touched
+static void uio48_test_bad_bits(struct kunit *test)
+{
+	struct uio48_kunit *k = test->priv;
+	struct uio48_dev *uiodev = &k->dev;
+	struct file file = { .private_data = uiodev };
+	static const unsigned long bits[] = { 0, 49, 255 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bits); i++) {
+		KUNIT_EXPECT_EQ(test, __device_ioctl(&file, IOCTL_ENAB_INT, bits[i] << 8 | 1),
+				-EINVAL);
+		KUNIT_EXPECT_EQ(test, __device_ioctl(&file, IOCTL_DISAB_INT, bits[i]), -EINVAL);
+		KUNIT_EXPECT_EQ(test, __device_ioctl(&file, IOCTL_CLR_INT, bits[i]), -EINVAL);
+	}
+
+	// far past the images, as a wide ioctl argument could ask
+	KUNIT_EXPECT_EQ(test, __device_ioctl(&file, IOCTL_ENAB_INT, 4096UL << 8), -EINVAL);
+
+	KUNIT_EXPECT_EQ(test, k->logged, 0);
+	KUNIT_EXPECT_FALSE(test, hrtimer_is_queued(&uiodev->cos_timer));
+	KUNIT_EXPECT_NULL(test, memchr_inv(uiodev->enab_image, 0, 6));
+	KUNIT_EXPECT_NULL(test, memchr_inv(uiodev->pol_image, 0, 6));
+
+	// the edges of the range still work
+	KUNIT_EXPECT_EQ(test, __device_ioctl(&file, IOCTL_ENAB_INT, 1UL << 8 | 1), 0);
+	KUNIT_EXPECT_EQ(test, __device_ioctl(&file, IOCTL_ENAB_INT, 48UL << 8 | 1), 0);
+	KUNIT_EXPECT_EQ(test, uiodev->enab_image[0], 0x01);
+	KUNIT_EXPECT_EQ(test, uiodev->enab_image[5], 0x80);
+}
+
+static void uio48_test_bench_isr(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+	struct uio48_event ev;
+
+	bench_isr(uiodev, KUNIT_BENCH);
+	kunit_info(test, "%s", uiodev->bench_result);
+
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, &ev, 1), 0);
+	KUNIT_EXPECT_EQ(test, uiodev->overruns, 0);
+}
+
+static void uio48_test_bench_ring(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+	struct uio48_event ev;
+
+	bench_ring(uiodev, 10 * KUNIT_BENCH);
+	kunit_info(test, "%s", uiodev->bench_result);
+
+	KUNIT_EXPECT_EQ(test, get_events(uiodev, &ev, 1), 0);
+	KUNIT_EXPECT_GT(test, uiodev->overruns, 0);
+}
+
+static void uio48_test_bench_io(struct kunit *test)
+{
+	struct uio48_dev *uiodev = &((struct uio48_kunit *)test->priv)->dev;
+
+	bench_io(uiodev, KUNIT_BENCH);
+	kunit_info(test, "%s", uiodev->bench_result);
+
+	// odd iterations write a 1, the last one included
+	KUNIT_EXPECT_EQ(test, read_bit(uiodev, 1), 1);
+}
+
+// Timing runs are skipped by kunit.py --filter speed>slow
+#ifdef KUNIT_CASE_SLOW
+#define UIO48_BENCH_CASE(name)	KUNIT_CASE_SLOW(name)
+#else
+#define UIO48_BENCH_CASE(name)	KUNIT_CASE(name)
+#endif
+
+static struct kunit_case uio48_kunit_cases[] = {
+	KUNIT_CASE(uio48_test_isr_latch),
+	KUNIT_CASE(uio48_test_ring_wrap),
+	KUNIT_CASE(uio48_test_moderation),
+	KUNIT_CASE(uio48_test_page_sequences),
+	KUNIT_CASE(uio48_test_bad_bits),
+	UIO48_BENCH_CASE(uio48_test_bench_isr),
+	UIO48_BENCH_CASE(uio48_test_bench_ring),
+	UIO48_BENCH_CASE(uio48_test_bench_io),
+	{}
+};
+
+static struct kunit_suite uio48_kunit_suite = {
+	.name = "uio48",
+	.init = uio48_kunit_init,
+	.exit = uio48_kunit_exit,
+	.test_cases = uio48_kunit_cases,
+};
+
+kunit_test_suite(uio48_kunit_suite);
@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the uio48 driver
+ *
+ * Enable with e.g.
+ *	trace-cmd record -e uio48
+ *	perf record -e 'uio48:*'
+ *
+ * An event's life is uio48_irq_entry, uio48_enqueue, uio48_wakeup and
+ * finally uio48_dequeue in the reader, all stamped by the tracer, so the
+ * gaps split it into ISR, queueing and scheduling time.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uio48
+
+#if !defined(_UIO48_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UIO48_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define UIO48_LOCK_MTX		0
+#define UIO48_LOCK_SPNLCK	1
+#define UIO48_LOCK_PORT		2
+
+#define show_uio48_lock(lock)					\
+	__print_symbolic(lock,					\
+			 { UIO48_LOCK_MTX,	"mtx" },	\
+			 { UIO48_LOCK_SPNLCK,	"spnlck" },	\
+			 { UIO48_LOCK_PORT,	"port_lock" })
+
+/* Fires before the handler touches a register, irq is 0 when polled */
+TRACE_EVENT(uio48_irq_entry,
+
+	TP_PROTO(int chip, int irq),
+
+	TP_ARGS(chip, irq),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(int, irq)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->irq = irq;
+	),
+
+	TP_printk("chip=%d irq=%d", __entry->chip, __entry->irq)
+);
+
+/* pending is the interrupt ID of ports 0-2, bit 1 in bit 0 */
+TRACE_EVENT(uio48_irq_exit,
+
+	TP_PROTO(int chip, u32 pending),
+
+	TP_ARGS(chip, pending),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(u32, pending)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->pending = pending;
+	),
+
+	TP_printk("chip=%d pending=%06x", __entry->chip, __entry->pending)
+);
+
+TRACE_EVENT(uio48_enqueue,
+
+	TP_PROTO(int chip, int bit, int flags, int depth),
+
+	TP_ARGS(chip, bit, flags, depth),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(int, bit)
+		__field(int, flags)
+		__field(int, depth)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->bit = bit;
+		__entry->flags = flags;
+		__entry->depth = depth;
+	),
+
+	TP_printk("chip=%d bit=%d flags=%x depth=%d",
+		  __entry->chip, __entry->bit, __entry->flags, __entry->depth)
+);
+
+TRACE_EVENT(uio48_dequeue,
+
+	TP_PROTO(int chip, int count, int depth),
+
+	TP_ARGS(chip, count, depth),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(int, count)
+		__field(int, depth)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->count = count;
+		__entry->depth = depth;
+	),
+
+	TP_printk("chip=%d count=%d depth=%d",
+		  __entry->chip, __entry->count, __entry->depth)
+);
+
+TRACE_EVENT(uio48_wakeup,
+
+	TP_PROTO(int chip, int depth),
+
+	TP_ARGS(chip, depth),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(int, depth)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->depth = depth;
+	),
+
+	TP_printk("chip=%d depth=%d", __entry->chip, __entry->depth)
+);
+
+TRACE_EVENT(uio48_ioctl,
+
+	TP_PROTO(int chip, unsigned int cmd, long ret, u64 duration_ns),
+
+	TP_ARGS(chip, cmd, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("chip=%d cmd=%u ret=%ld duration_ns=%llu",
+		  __entry->chip, _IOC_NR(__entry->cmd), __entry->ret,
+		  __entry->duration_ns)
+);
+
+DECLARE_EVENT_CLASS(uio48_lock_class,
+
+	TP_PROTO(int chip, int lock),
+
+	TP_ARGS(chip, lock),
+
+	TP_STRUCT__entry(
+		__field(int, chip)
+		__field(int, lock)
+	),
+
+	TP_fast_assign(
+		__entry->chip = chip;
+		__entry->lock = lock;
+	),
+
+	TP_printk("chip=%d lock=%s", __entry->chip, show_uio48_lock(__entry->lock))
+);
+
+DEFINE_EVENT(uio48_lock_class, uio48_lock_acquire,
+	TP_PROTO(int chip, int lock),
+	TP_ARGS(chip, lock)
+);
+
+DEFINE_EVENT(uio48_lock_class, uio48_lock_release,
+	TP_PROTO(int chip, int lock),
+	TP_ARGS(chip, lock)
+);
+
+#endif /* _UIO48_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE uio48_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,592 @@
+///****************************************************************************
+//
+//	Copyright 2011 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+///****************************************************************************
+//
+//	Name	 : uio48dispatch.c
+//
+//	Project	 : UIO48 Linux Device Driver
+//
+//	Event dispatcher. Applications register a handler per chip, bit and
+//	edge instead of running a wait_int() loop with a switch on the bit.
+//
+//	One intake thread per chip reads events in batches and appends each
+//	to the mailbox of its bit, a single producer, single consumer ring.
+//	A bit with work is scheduled once on the run queue of its home
+//	worker; a worker runs up to a batch of the bit's events, and idle
+//	workers steal bits from the other queues. A bit is only ever run by
+//	one worker at a time, so its handlers see its events in order, while
+//	different bits run in parallel. Intake never waits for a handler; an
+//	event arriving at a full mailbox is dropped and counted instead.
+//
+///****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// Include the WinSystems UIO48 definitions
+#include "uio48.h"
+
+int read_events(int chip_number, struct uio48_event *events, int max_events);
+
+#define MAX_KEYS	(MAX_CHIPS * 48)
+
+// Run queue cells. Each bit is queued at most once, so a queue never
+// holds more than MAX_KEYS entries.
+#define RUNQ_SIZE	256
+
+#define EDGES		3		// rising, falling, pulse
+
+struct handler {
+	uio48_handler fn;
+	void *arg;
+};
+
+// per bit state, see dispatch_event()
+struct key {
+	struct handler handlers[EDGES];
+	int scheduled;				// set while the bit is queued or running
+	unsigned head;				// next event to run, owned by the worker
+	unsigned tail;				// next free slot, owned by intake
+	struct uio48_event *ring;	// mailbox, queue_size records
+};
+
+// bounded multi producer, multi consumer queue of bit indices
+struct runq_cell {
+	unsigned seq;
+	int key;
+};
+
+struct runq {
+	unsigned head;
+	char pad0[60];
+	unsigned tail;
+	char pad1[60];
+	struct runq_cell cells[RUNQ_SIZE];
+};
+
+struct uio48_dispatcher {
+	struct uio48_dispatch_config cfg;
+	struct key keys[MAX_KEYS];
+	unsigned chips;				// bit n set if chip n+1 has handlers
+	int started;
+	int stop;
+	unsigned long long dropped;
+	sem_t work;					// one count per queued bit
+	struct runq *queues;		// one per worker
+	pthread_t intake[MAX_CHIPS];
+	pthread_t *workers;
+};
+
+// thread argument, id is the worker or the 0 based chip index
+struct thread_arg {
+	struct uio48_dispatcher *d;
+	int id;
+};
+
+static void runq_init(struct runq *q)
+{
+	int x;
+
+	q->head = q->tail = 0;
+
+	for(x = 0; x < RUNQ_SIZE; x++)
+		q->cells[x].seq = x;
+}
+
+static int runq_push(struct runq *q, int key)
+{
+	struct runq_cell *cell;
+	unsigned pos;
+	int diff;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	for(;;)
+	{
+		cell = &q->cells[pos % RUNQ_SIZE];
+		diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return -1;		// full
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+
+	cell->key = key;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int runq_pop(struct runq *q)
+{
+	struct runq_cell *cell;
+	unsigned pos;
+	int diff, key;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	for(;;)
+	{
+		cell = &q->cells[pos % RUNQ_SIZE];
+		diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return -1;		// empty
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+
+	key = cell->key;
+	__atomic_store_n(&cell->seq, pos + RUNQ_SIZE, __ATOMIC_RELEASE);
+
+	return key;
+}
+
+// Queue a bit that was just marked scheduled and wake a worker
+static void schedule(struct uio48_dispatcher *d, int key, int worker)
+{
+	runq_push(&d->queues[worker], key);
+	sem_post(&d->work);
+}
+
+// Find a queued bit, our own queue first. Returns -1 when stopping.
+static int next_key(struct uio48_dispatcher *d, int id)
+{
+	int x, key;
+
+	for(;;)
+	{
+		if(__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE))
+			return -1;
+
+		for(x = 0; x < d->cfg.workers; x++)
+			if((key = runq_pop(&d->queues[(id + x) % d->cfg.workers])) >= 0)
+				return key;
+
+		// The push we were woken for is still being published
+		sched_yield();
+	}
+}
+
+// Run up to a batch of one bit's events in order
+static void dispatch_event(struct uio48_dispatcher *d, int key, int id)
+{
+	struct key *k = &d->keys[key];
+	struct uio48_event *ev;
+	unsigned head, tail, mask = d->cfg.queue_size - 1;
+	int n, edge;
+
+	head = k->head;
+	tail = __atomic_load_n(&k->tail, __ATOMIC_ACQUIRE);
+
+	for(n = 0; head != tail && n < d->cfg.batch; n++)
+	{
+		ev = &k->ring[head & mask];
+
+		for(edge = 0; edge < EDGES; edge++)
+			if((ev->flags & (1 << edge)) && k->handlers[edge].fn)
+				k->handlers[edge].fn(ev, k->handlers[edge].arg);
+
+		head++;
+		__atomic_store_n(&k->head, head, __ATOMIC_RELEASE);
+	}
+
+	// Still busy, go to the back of our queue so other bits get a turn
+	if(head != tail)
+	{
+		schedule(d, key, id);
+		return;
+	}
+
+	__atomic_store_n(&k->scheduled, 0, __ATOMIC_SEQ_CST);
+
+	// Intake may have seen the bit scheduled after its last append
+	if(__atomic_load_n(&k->tail, __ATOMIC_SEQ_CST) != head &&
+	   !__atomic_exchange_n(&k->scheduled, 1, __ATOMIC_SEQ_CST))
+		schedule(d, key, id);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct thread_arg *w = arg;
+	struct uio48_dispatcher *d = w->d;
+	int key;
+
+	for(;;)
+	{
+		while(sem_wait(&d->work) < 0 && errno == EINTR)
+			;
+
+		if((key = next_key(d, w->id)) < 0)
+			break;
+
+		dispatch_event(d, key, w->id);
+	}
+
+	free(w);
+
+	return NULL;
+}
+
+static void *intake_thread(void *arg)
+{
+	struct thread_arg *t = arg;
+	struct uio48_dispatcher *d = t->d;
+	struct uio48_event *events;
+	struct key *k;
+	unsigned tail;
+	int chip = t->id, n, x, key;
+
+	free(t);
+
+	events = malloc(d->cfg.batch * sizeof(*events));
+
+	if(events == NULL)
+		return NULL;
+
+	pthread_cleanup_push(free, events);
+
+	for(;;)
+	{
+		n = read_events(chip + 1, events, d->cfg.batch);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			perror("uio48 dispatch");
+			break;
+		}
+
+		for(x = 0; x < n; x++)
+		{
+			if(events[x].bit < 1 || events[x].bit > 48)
+				continue;
+
+			key = chip * 48 + events[x].bit - 1;
+			k = &d->keys[key];
+
+			if(k->ring == NULL)
+				continue;		// no handler for this bit
+
+			tail = k->tail;
+
+			if(tail - __atomic_load_n(&k->head, __ATOMIC_ACQUIRE) >= (unsigned)d->cfg.queue_size)
+			{
+				__atomic_add_fetch(&d->dropped, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			k->ring[tail & (d->cfg.queue_size - 1)] = events[x];
+			__atomic_store_n(&k->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+			if(!__atomic_exchange_n(&k->scheduled, 1, __ATOMIC_SEQ_CST))
+				schedule(d, key, key % d->cfg.workers);
+		}
+	}
+
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_dispatch_create - Create an event dispatcher
+//
+// Description:		This function allocates a dispatcher. Fields of cfg
+//					left 0 take their defaults: one worker per online CPU,
+//					mailboxes of 1024 events per bit and batches of 64
+//					events. queue_size is rounded up to a power of 2.
+//
+// Arguments:
+//			cfg			The configuration, or NULL for the defaults
+//
+// Returns:
+//			NULL	If memory could not be allocated
+//	or		The new dispatcher
+//
+//------------------------------------------------------------------------
+//
+struct uio48_dispatcher *uio48_dispatch_create(const struct uio48_dispatch_config *cfg)
+{
+	struct uio48_dispatcher *d;
+	int x;
+
+	d = calloc(1, sizeof(*d));
+
+	if(d == NULL)
+		return NULL;
+
+	if(cfg)
+		d->cfg = *cfg;
+
+	if(d->cfg.workers <= 0)
+		d->cfg.workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	if(d->cfg.queue_size <= 0)
+		d->cfg.queue_size = 1024;
+
+	if(d->cfg.batch <= 0)
+		d->cfg.batch = 64;
+
+	for(x = 1; x < d->cfg.queue_size; x <<= 1)
+		;
+
+	d->cfg.queue_size = x;
+
+	d->queues = malloc(d->cfg.workers * sizeof(struct runq));
+	d->workers = calloc(d->cfg.workers, sizeof(pthread_t));
+
+	if(d->queues == NULL || d->workers == NULL || sem_init(&d->work, 0, 0) < 0)
+	{
+		free(d->queues);
+		free(d->workers);
+		free(d);
+		return NULL;
+	}
+
+	for(x = 0; x < d->cfg.workers; x++)
+		runq_init(&d->queues[x]);
+
+	return d;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_dispatch_register - Register an event handler
+//
+// Description:		This function sets the handler run for events of one
+//					bit with any of the flags in edges. A later call for
+//					the same bit and edge replaces the handler, fn = NULL
+//					removes it. Handlers can only be changed before
+//					uio48_dispatch_start(). The interrupt itself still has
+//					to be enabled with enab_int().
+//
+// Arguments:
+//			d			The dispatcher
+//			chip_number	The 1 based index of the chip
+//			bit_number	The 1 based index of the bit
+//			edges		UIO48_EVENT_RISING, _FALLING and/or _PULSE
+//			fn			The handler
+//			arg			Passed to the handler with each event
+//
+// Returns:
+//			-1		If the arguments are invalid, the dispatcher is running
+//					or memory could not be allocated
+//	or		0		For success
+//
+//------------------------------------------------------------------------
+//
+int uio48_dispatch_register(struct uio48_dispatcher *d, int chip_number,
+							int bit_number, int edges, uio48_handler fn,
+							void *arg)
+{
+	struct key *k;
+	int edge;
+
+	if(chip_number < 1 || chip_number > MAX_CHIPS || bit_number < 1 ||
+	   bit_number > 48 || (edges & ~(UIO48_EVENT_RISING | UIO48_EVENT_FALLING |
+									 UIO48_EVENT_PULSE)) || d->started)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	k = &d->keys[(chip_number - 1) * 48 + bit_number - 1];
+
+	if(k->ring == NULL)
+	{
+		k->ring = malloc(d->cfg.queue_size * sizeof(struct uio48_event));
+
+		if(k->ring == NULL)
+			return -1;
+	}
+
+	for(edge = 0; edge < EDGES; edge++)
+	{
+		if(edges & (1 << edge))
+		{
+			k->handlers[edge].fn = fn;
+			k->handlers[edge].arg = arg;
+		}
+	}
+
+	d->chips |= 1 << (chip_number - 1);
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_dispatch_start - Start dispatching events
+//
+// Description:		This function starts the workers and one intake thread
+//					for each chip with a registered handler. The intake
+//					threads open the chips like any other library call.
+//
+// Arguments:
+//			d			The dispatcher
+//
+// Returns:
+//			-1		If it is already running or a thread failed to start
+//	or		0		For success
+//
+//------------------------------------------------------------------------
+//
+int uio48_dispatch_start(struct uio48_dispatcher *d)
+{
+	struct thread_arg *t;
+	int x;
+
+	if(d->started)
+		return -1;
+
+	d->started = 1;
+
+	for(x = 0; x < d->cfg.workers + MAX_CHIPS; x++)
+	{
+		if(x >= d->cfg.workers && !((d->chips >> (x - d->cfg.workers)) & 1))
+			continue;
+
+		t = malloc(sizeof(*t));
+
+		if(t == NULL)
+			return -1;
+
+		t->d = d;
+
+		if(x < d->cfg.workers)
+		{
+			t->id = x;
+
+			if(pthread_create(&d->workers[x], NULL, worker_thread, t) == 0)
+				continue;
+		}
+		else
+		{
+			t->id = x - d->cfg.workers;
+
+			if(pthread_create(&d->intake[t->id], NULL, intake_thread, t) == 0)
+				continue;
+		}
+
+		free(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_dispatch_stop - Stop and free a dispatcher
+//
+// Description:		This function stops the intake threads, lets the
+//					handlers that are running return, stops the workers
+//					and frees the dispatcher. Events not yet handled are
+//					discarded. It must not be called from a handler.
+//
+// Arguments:
+//			d			The dispatcher
+//
+// Returns:
+//			Nothing
+//
+//------------------------------------------------------------------------
+//
+void uio48_dispatch_stop(struct uio48_dispatcher *d)
+{
+	int x;
+
+	if(d->started)
+	{
+		// Intake blocks in read(), a cancellation point
+		for(x = 0; x < MAX_CHIPS; x++)
+		{
+			if((d->chips >> x) & 1 && d->intake[x])
+			{
+				pthread_cancel(d->intake[x]);
+				pthread_join(d->intake[x], NULL);
+			}
+		}
+
+		__atomic_store_n(&d->stop, 1, __ATOMIC_RELEASE);
+
+		for(x = 0; x < d->cfg.workers; x++)
+			sem_post(&d->work);
+
+		for(x = 0; x < d->cfg.workers; x++)
+			if(d->workers[x])
+				pthread_join(d->workers[x], NULL);
+	}
+
+	for(x = 0; x < MAX_KEYS; x++)
+		free(d->keys[x].ring);
+
+	sem_destroy(&d->work);
+	free(d->queues);
+	free(d->workers);
+	free(d);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_dispatch_dropped - Count of events dropped by a dispatcher
+//
+// Description:		This function returns how many events found the
+//					mailbox of their bit full because its handlers fell
+//					behind. Events lost in the driver are counted in the
+//					overruns field of struct uio48_state instead.
+//
+// Arguments:
+//			d			The dispatcher
+//
+// Returns:
+//			The number of events dropped
+//
+//------------------------------------------------------------------------
+//
+unsigned long long uio48_dispatch_dropped(struct uio48_dispatcher *d)
+{
+	return __atomic_load_n(&d->dropped, __ATOMIC_RELAXED);
+}
@@ -33,9 +33,16 @@
 ///****************************************************************************
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>      /* open */ 
 #include <unistd.h>     /* exit */
 #include <sys/ioctl.h>  /* ioctl */
+#include <sys/mman.h>   /* mmap */
+#include <string.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <sys/io.h>     /* ioperm, inb, outb */
+#define HAVE_PORT_IO	1
+#endif
 
 // Include the WinSystems UIO48 definitions
 #include "uio48.h"    
@@ -45,15 +52,71 @@
 //**************************************************************************
 
 int check_handle(int chip_number);
+static int txn_write(int chip, int port, int mask, int val);
+static int txn_write_bit(int chip, int bit_number, int val);
+static void copy_state(const volatile struct uio48_state *page,
+					   struct uio48_state *state);
+
+// direct port I/O backend, see direct_open()
+struct uio48_direct {
+	unsigned base_port;
+	unsigned *images;		// output images shared with the driver
+};
+
+static int direct_open(int fd, struct uio48_direct *d);
+static struct uio48_direct *direct_port(int chip, struct uio48_direct *d,
+										int port);
+static struct uio48_direct *direct_bit(int chip, struct uio48_direct *d,
+									   int bit_number);
+static int direct_read(struct uio48_direct *d, int port);
+static int direct_write(struct uio48_direct *d, int port, int mask, int val);
+static const struct uio48_backend *get_backend(void);
+
+// The simulator is only there when uio48sim.o is linked in
+#pragma weak uio48_sim_backend
+
+// per-context state, see uio48_open()
+struct uio48_ctx {
+	int fd;
+	int chip_number;
+	const volatile struct uio48_state *state;
+	struct uio48_direct direct;
+};
+
+// the register backend, see get_backend()
+static const struct uio48_backend *backend;
+
+// direct I/O state of the legacy handles
+static struct uio48_direct direct[MAX_CHIPS];
+
+// chips this thread has been granted port access to, 2 if that failed.
+// ioperm() permissions belong to the calling thread.
+static __thread unsigned char io_granted[MAX_CHIPS];
 
 // device handles
 int handle[MAX_CHIPS] = {0,0,0,0};
 
-// the names of our device nodes
-char *device_id[MAX_CHIPS]={"/dev/uio48a",
+// handle of the aggregate node, opened by read_all_events()
+static int all_handle;
+
+// mapped state pages
+const volatile struct uio48_state *state_page[MAX_CHIPS];
+
+// open output transactions, one per chip and thread
+struct uio48_txn {
+	int active;
+	unsigned char base[6];		// port images when the transaction began
+	unsigned char image[6];		// port images with the recorded writes
+};
+
+static __thread struct uio48_txn txn[MAX_CHIPS];
+
+// the names of our device nodes, the aggregate node last
+char *device_id[MAX_CHIPS + 1]={"/dev/uio48a",
 							"/dev/uio48b",
 							"/dev/uio48c",
-							"/dev/uio48d"};
+							"/dev/uio48d",
+							"/dev/uio48all"};
 
 //
 //------------------------------------------------------------------------
@@ -77,6 +140,7 @@ char *device_id[MAX_CHIPS]={"/dev/uio48a",
 //
 int read_bit(int chip_number, int bit_number)
 {
+	struct uio48_direct *d;
 	int c;
 
     --chip_number;
@@ -84,7 +148,11 @@ int read_bit(int chip_number, int bit_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_READ_BIT, bit_number);
+	// The direct backend reads the port itself
+	if((d = direct_bit(chip_number, &direct[chip_number], bit_number)))
+		return (direct_read(d, (bit_number-1) / 8) >> ((bit_number-1) % 8)) & 1;
+
+    c = backend->ioctl(handle[chip_number], IOCTL_READ_BIT, bit_number);
     
     return c;
 }
@@ -112,6 +180,7 @@ int read_bit(int chip_number, int bit_number)
 //
 int write_bit(int chip_number, int bit_number, int val)
 {
+	struct uio48_direct *d;
 	int c;
 
     --chip_number;
@@ -119,7 +188,15 @@ int write_bit(int chip_number, int bit_number, int val)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_WRITE_BIT, bit_number << 8 | val);
+	if(txn[chip_number].active)		// Record it, commit_transaction writes it
+		return txn_write_bit(chip_number, bit_number, val);
+
+	// The direct backend writes the port itself
+	if((d = direct_bit(chip_number, &direct[chip_number], bit_number)))
+		return direct_write(d, (bit_number-1) / 8, 1 << ((bit_number-1) % 8),
+							val ? 0xff : 0);
+
+    c = backend->ioctl(handle[chip_number], IOCTL_WRITE_BIT, bit_number << 8 | val);
 
     return c;
 }
@@ -146,6 +223,7 @@ int write_bit(int chip_number, int bit_number, int val)
 //
 int set_bit(int chip_number, int bit_number)
 {
+	struct uio48_direct *d;
 	int c;
 
     --chip_number;
@@ -153,7 +231,15 @@ int set_bit(int chip_number, int bit_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_SET_BIT, bit_number);
+	if(txn[chip_number].active)		// Record it, commit_transaction writes it
+		return txn_write_bit(chip_number, bit_number, 1);
+
+	// The direct backend writes the port itself
+	if((d = direct_bit(chip_number, &direct[chip_number], bit_number)))
+		return direct_write(d, (bit_number-1) / 8, 1 << ((bit_number-1) % 8),
+							0xff);
+
+    c = backend->ioctl(handle[chip_number], IOCTL_SET_BIT, bit_number);
 
     return c;
 }
@@ -180,6 +266,7 @@ int set_bit(int chip_number, int bit_number)
 //
 int clr_bit(int chip_number, int bit_number)
 {
+	struct uio48_direct *d;
 	int c;
 
     --chip_number;
@@ -187,7 +274,15 @@ int clr_bit(int chip_number, int bit_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_CLR_BIT, bit_number);
+	if(txn[chip_number].active)		// Record it, commit_transaction writes it
+		return txn_write_bit(chip_number, bit_number, 0);
+
+	// The direct backend writes the port itself
+	if((d = direct_bit(chip_number, &direct[chip_number], bit_number)))
+		return direct_write(d, (bit_number-1) / 8, 1 << ((bit_number-1) % 8),
+							0);
+
+    c = backend->ioctl(handle[chip_number], IOCTL_CLR_BIT, bit_number);
 
     return c;
 }
@@ -201,7 +296,8 @@ int clr_bit(int chip_number, int bit_number)
 // Description:		This function enables notification of a single input points
 //					change to the specified state. It does this by calling
 //					the UIO48 device drivers IOCTL_ENAB_INT method and
-//					returning the result
+//					returning the result. Bits 25-48 have no interrupt
+//					hardware and are sampled by the driver instead.
 //
 // Arguments:
 //			chip_number	The 1 based index of the chip
@@ -223,7 +319,7 @@ int enab_int(int chip_number, int bit_number, int polarity)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_ENAB_INT, bit_number<<8 | polarity);
+    c = backend->ioctl(handle[chip_number], IOCTL_ENAB_INT, bit_number<<8 | polarity);
 
     return c;
 }
@@ -258,7 +354,7 @@ int disab_int(int chip_number, int bit_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_DISAB_INT, bit_number);
+    c = backend->ioctl(handle[chip_number], IOCTL_DISAB_INT, bit_number);
 
     return c;
 }
@@ -292,7 +388,7 @@ int clr_int(int chip_number, int bit_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_CLR_INT, bit_number);
+    c = backend->ioctl(handle[chip_number], IOCTL_CLR_INT, bit_number);
 
     return c;
 }
@@ -325,7 +421,7 @@ int get_int(int chip_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_GET_INT, 0);
+    c = backend->ioctl(handle[chip_number], IOCTL_GET_INT, 0);
 
     return c;
 }
@@ -358,7 +454,7 @@ int wait_int(int chip_number)
     if(check_handle(chip_number))   /* Check for chip available */
 		return -1;
 
-    c = ioctl(handle[chip_number], IOCTL_WAIT_INT, 0);
+    c = backend->ioctl(handle[chip_number], IOCTL_WAIT_INT, 0);
 
     return c;
 }
@@ -386,7 +482,7 @@ int read_int_pending(int chip_number)
 		return(-1);						// Return -1 if not
 
 	// Call the drivers IOCTL method and return the result
-	return(ioctl(handle[chip_number-1], IOCTL_READ_PORT, 6));
+	return(backend->ioctl(handle[chip_number-1], IOCTL_READ_PORT, 6));
 }
 
 //
@@ -414,7 +510,7 @@ int clr_int_id(int chip_number, int port_number)
 		return(-1);						// Return -1 if not
 
 	// Call the drivers IOCTL method and return the result
-	return(ioctl(handle[chip_number-1], IOCTL_CLR_INT_ID, port_number));
+	return(backend->ioctl(handle[chip_number-1], IOCTL_CLR_INT_ID, port_number));
 }
 
 //
@@ -437,11 +533,17 @@ int clr_int_id(int chip_number, int port_number)
 //
 int read_byte(int chip_number, int port_number)
 {
+	struct uio48_direct *d;
+
     if(check_handle(chip_number-1))		// Check for chip available
 		return(-1);						// Return -1 if not
 
+	// The direct backend reads ports 0-5 itself
+	if((d = direct_port(chip_number-1, &direct[chip_number-1], port_number)))
+		return direct_read(d, port_number);
+
 	// Call the drivers IOCTL method and return the result
-	return(ioctl(handle[chip_number-1], IOCTL_READ_PORT, port_number));
+	return(backend->ioctl(handle[chip_number-1], IOCTL_READ_PORT, port_number));
 }
 
 //
@@ -465,11 +567,21 @@ int read_byte(int chip_number, int port_number)
 //
 int write_byte(int chip_number, int port_number, int val)
 {
+	struct uio48_direct *d;
+
     if(check_handle(chip_number-1))		// Check for chip available
 		return(-1);						// Return -1 if not
 
+	// Output ports are recorded while a transaction is open
+	if(txn[chip_number-1].active && port_number >= 0 && port_number < 6)
+		return txn_write(chip_number-1, port_number, 0xff, val);
+
+	// The direct backend writes ports 0-5 itself
+	if((d = direct_port(chip_number-1, &direct[chip_number-1], port_number)))
+		return direct_write(d, port_number, 0xff, val);
+
 	// Call the drivers IOCTL method and return the result
-	return(ioctl(handle[chip_number-1], IOCTL_WRITE_PORT, ((port_number << 8) | val) ));
+	return(backend->ioctl(handle[chip_number-1], IOCTL_WRITE_PORT, ((port_number << 8) | val) ));
 }
 
 //
@@ -497,7 +609,7 @@ int lock_port(int chip_number, int port_number)
 		return(-1);						// Return -1 if not
 
 	// Call the drivers IOCTL method and return the result
-	return(ioctl(handle[chip_number-1], IOCTL_LOCK_PORT, port_number));
+	return(backend->ioctl(handle[chip_number-1], IOCTL_LOCK_PORT, port_number));
 }
 
 //
@@ -525,40 +637,1494 @@ int unlock_port(int chip_number, int port_number)
 		return(-1);						// Return -1 if not
 
 	// Call the drivers IOCTL method and return the result
-	return(ioctl(handle[chip_number-1], IOCTL_UNLOCK_PORT, port_number));
+	return(backend->ioctl(handle[chip_number-1], IOCTL_UNLOCK_PORT, port_number));
 }
 
 //
 //------------------------------------------------------------------------
 //
-// check_handle - Checks that a handle to the appropriate device file
-//					exists. If it does not a file open is performed.
+// set_moderation - Set the interrupt moderation thresholds.
 //
-// Description:
+// Description:		This function sets how many events must be queued, or
+//					how old the oldest queued event must be, before a
+//					waiter is woken. It does this by calling the UIO48
+//					device drivers IOCTL_SET_MODERATION method.
 //
 // Arguments:
 //			chip_number	The 1 based index of the chip
+//			count		Wake after this many events (1 = every event)
+//			usecs		Or once the oldest event is this old (0 = never)
 //
 // Returns:
-//			0		if handle is valid
 //			-1		If the chip does not exist or it's handle is invalid
+//	or		The result of the IOCTL_SET_MODERATION call
 //
 //------------------------------------------------------------------------
 //
-int check_handle(int chip_number)
+int set_moderation(int chip_number, int count, int usecs)
 {
-    if(handle[chip_number] > 0)	// If it's already a valid handle
-		return 0;
+	struct uio48_moderation mod;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	mod.count = count;
+	mod.usecs = usecs;
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_SET_MODERATION, (unsigned long)&mod));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// get_moderation - Read the interrupt moderation thresholds.
+//
+// Description:		This function returns the thresholds last set with
+//					set_moderation(), so a tool can restore them. It calls
+//					the UIO48 device drivers IOCTL_GET_MODERATION method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			count		Receives the event count threshold
+//			usecs		Receives the age threshold in microseconds
+//
+// Returns:
+//			-1		If the chip does not exist or it's handle is invalid
+//	or		The result of the IOCTL_GET_MODERATION call
+//
+//------------------------------------------------------------------------
+//
+int get_moderation(int chip_number, int *count, int *usecs)
+{
+	struct uio48_moderation mod;
+	int ret_val;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	// Call the drivers IOCTL method
+	ret_val = backend->ioctl(handle[chip_number-1], IOCTL_GET_MODERATION, (unsigned long)&mod);
+
+	if(ret_val == 0)
+	{
+		*count = mod.count;
+		*usecs = mod.usecs;
+	}
+
+	return(ret_val);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// set_eventfd - Signal an eventfd as events are queued.
+//
+// Description:		This function registers an eventfd that the driver
+//					adds the number of newly queued events to whenever
+//					waiters are woken (just 1 on kernels 6.8 and later),
+//					so event loops can wait for the chip without a
+//					thread in wait_int(). It calls the
+//					UIO48 device drivers IOCTL_SET_EVENTFD method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			fd			An eventfd(2) descriptor, or -1 to unregister
+//
+// Returns:
+//			-1		If the chip does not exist or it's handle is invalid
+//	or		The result of the IOCTL_SET_EVENTFD call
+//
+//------------------------------------------------------------------------
+//
+int set_eventfd(int chip_number, int fd)
+{
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_SET_EVENTFD, fd));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// set_wait_mode - Choose how waiters are woken.
+//
+// Description:		This function selects the chip's wait mode. In the
+//					default UIO48_WAIT_SHARED mode every thread blocked in
+//					wait_int() or read_events() wakes on each event. In
+//					UIO48_WAIT_EXCLUSIVE mode each event wakes only one of
+//					them, for pools of workers sharing the chip. It calls
+//					the UIO48 device drivers IOCTL_SET_WAIT_MODE method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			mode		UIO48_WAIT_SHARED or UIO48_WAIT_EXCLUSIVE
+//
+// Returns:
+//			-1		If the chip does not exist or it's handle is invalid
+//	or		The result of the IOCTL_SET_WAIT_MODE call
+//
+//------------------------------------------------------------------------
+//
+int set_wait_mode(int chip_number, int mode)
+{
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_SET_WAIT_MODE, mode));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// set_sigio - Deliver SIGIO to this process as events are queued.
+//
+// Description:		This function turns asynchronous notification on or
+//					off for the chip's device node. While on, the driver
+//					sends SIGIO to the calling process whenever waiters
+//					are woken. The simulated backend has no device node
+//					and does not support it.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			on			1 to enable SIGIO, 0 to disable it
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or fcntl() failed
+//	or		0		Success
+//
+//------------------------------------------------------------------------
+//
+int set_sigio(int chip_number, int on)
+{
+	int fd, flags;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	if(backend != &uio48_kernel_backend && backend != &uio48_direct_backend)
+		return(-1);
+
+	fd = handle[chip_number-1];
+
+	if(on && fcntl(fd, F_SETOWN, getpid()) < 0)
+		return(-1);
+
+	flags = fcntl(fd, F_GETFL);
+
+	if(flags < 0)
+		return(-1);
+
+	flags = on ? flags | O_ASYNC : flags & ~O_ASYNC;
+
+	return(fcntl(fd, F_SETFL, flags) < 0 ? -1 : 0);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// read_events - Read a batch of event records.
+//
+// Description:		This function reads up to max_events queued event
+//					records from the driver in a single call. It blocks
+//					until the moderation thresholds are met.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			events		Buffer to receive the records
+//			max_events	The number of records the buffer holds
+//
+// Returns:
+//			-1		If the chip does not exist or it's handle is invalid
+//	or		The number of records read
+//
+//------------------------------------------------------------------------
+//
+int read_events(int chip_number, struct uio48_event *events, int max_events)
+{
+	ssize_t c;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	c = backend->read(handle[chip_number-1], events, max_events * sizeof(struct uio48_event));
 
-    if(handle[chip_number] == -1)	// If it's already been tried
+	if(c < 0)
 		return -1;
 
-	// Try opening the device file, in case it hasn't been opened yet
-    handle[chip_number] = open(device_id[chip_number], O_RDWR);
+	return c / sizeof(struct uio48_event);
+}
 
-    if(handle[chip_number] > 0)	// If it's now a validopen handle
-		return 0;
-    
-    handle[chip_number] = -1;
+//
+//------------------------------------------------------------------------
+//
+// read_all_events - Read a batch of event records from every chip.
+//
+// Description:		This function reads up to max_events queued event
+//					records from the aggregate device node, which merges
+//					the events of all chips in arrival order. Use the chip
+//					field of each record to tell them apart. Only events
+//					queued after the first call are seen, the driver does
+//					not copy them while the node is closed. It blocks
+//					until at least one event is queued, regardless of the
+//					chips' moderation. The simulated backend has no
+//					aggregate node.
+//
+// Arguments:
+//			events		Buffer to receive the records
+//			max_events	The number of records the buffer holds
+//
+// Returns:
+//			-1		If the aggregate node cannot be opened
+//	or		The number of records read
+//
+//------------------------------------------------------------------------
+//
+int read_all_events(struct uio48_event *events, int max_events)
+{
+	int fd, expected = 0;
+	ssize_t c;
+
+	fd = __atomic_load_n(&all_handle, __ATOMIC_ACQUIRE);
+
+	if(fd == 0)
+	{
+		fd = get_backend()->open(MAX_CHIPS);
+
+		if(fd <= 0)
+			fd = -1;
+
+		// Publish our result unless another thread beat us to it
+		if(!__atomic_compare_exchange_n(&all_handle, &expected, fd, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			if(fd > 0)
+				backend->close(fd);
+
+			fd = expected;
+		}
+	}
+
+	if(fd < 0)
+		return -1;
+
+	c = backend->read(fd, events, max_events * sizeof(struct uio48_event));
+
+	if(c < 0)
 		return -1;
+
+	return c / sizeof(struct uio48_event);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// wait_pattern - Wait for the inputs to match a pattern.
+//
+// Description:		This function sleeps until the 48 input bits selected
+//					by mask equal the corresponding bits of value. It
+//					does this by calling the UIO48 device drivers
+//					IOCTL_WAIT_PATTERN method. Use UIO48_BIT() to build
+//					the mask and value.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			mask		The bits to compare
+//			value		The required state of those bits
+//			timeout_ms	The maximum time to wait (0 = forever)
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or the timeout expired (errno is ETIMEDOUT)
+//	or		0		When the pattern matched
+//
+//------------------------------------------------------------------------
+//
+int wait_pattern(int chip_number, unsigned long long mask,
+				 unsigned long long value, int timeout_ms)
+{
+	struct uio48_pattern pat;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	pat.mask = mask;
+	pat.value = value;
+	pat.timeout_ms = timeout_ms;
+	pat.reserved = 0;
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_WAIT_PATTERN, (unsigned long)&pat));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// pulse_bits - Generate a timed pulse on one or more output points.
+//
+// Description:		This function drives the output bits selected by mask
+//					to the active level and has the driver return them to
+//					the inactive level width_us microseconds later. It
+//					returns immediately. It does this by calling the
+//					UIO48 device drivers IOCTL_PULSE method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			mask		The bits to pulse, built with UIO48_BIT()
+//			width_us	The pulse width in microseconds
+//			polarity	1 for a high going pulse, 0 for a low going one
+//			flags		UIO48_PULSE_NOTIFY to queue an event at the end
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or the bits are already being pulsed
+//	or		The result of the IOCTL_PULSE call (the pulse slot)
+//
+//------------------------------------------------------------------------
+//
+int pulse_bits(int chip_number, unsigned long long mask, int width_us,
+			   int polarity, int flags)
+{
+	struct uio48_pulse pulse;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	pulse.mask = mask;
+	pulse.width_us = width_us;
+	pulse.polarity = polarity;
+	pulse.flags = flags;
+	pulse.reserved[0] = pulse.reserved[1] = 0;
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_PULSE, (unsigned long)&pulse));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// set_pwm - Drive an output point with a software PWM waveform.
+//
+// Description:		This function has the driver toggle a single output
+//					point so that it is high for duty_us out of every
+//					period_us. It does this by calling the UIO48 device
+//					drivers IOCTL_SET_PWM method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			bit_number	The 1 based index of the bit
+//			period_us	The period in microseconds (0 = stop)
+//			duty_us		The high time in microseconds
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or the parameters are out of range
+//	or		The result of the IOCTL_SET_PWM call
+//
+//------------------------------------------------------------------------
+//
+int set_pwm(int chip_number, int bit_number, int period_us, int duty_us)
+{
+	struct uio48_pwm pwm;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	pwm.bit = bit_number;
+	pwm.reserved[0] = pwm.reserved[1] = pwm.reserved[2] = 0;
+	pwm.period_us = period_us;
+	pwm.duty_us = duty_us;
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_SET_PWM, (unsigned long)&pwm));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// set_encoder - Configure a quadrature encoder on two input points.
+//
+// Description:		This function has the driver decode a quadrature
+//					encoder connected to two interrupt capable inputs
+//					(bits 1-24) and zeroes its position. It does this by
+//					calling the UIO48 device drivers IOCTL_SET_ENCODER
+//					method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			index		The encoder number (0 to UIO48_MAX_ENCODERS-1)
+//			bit_a		The 1 based index of the A input
+//			bit_b		The 1 based index of the B input (0 = remove)
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or the bits are invalid or already in use
+//	or		The result of the IOCTL_SET_ENCODER call
+//
+//------------------------------------------------------------------------
+//
+int set_encoder(int chip_number, int index, int bit_a, int bit_b)
+{
+	struct uio48_encoder enc;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	enc.index = index;
+	enc.bit_a = bit_a;
+	enc.bit_b = bit_b;
+	enc.enable = (bit_a != 0 && bit_b != 0);
+
+	// Call the drivers IOCTL method and return the result
+	return(backend->ioctl(handle[chip_number-1], IOCTL_SET_ENCODER, (unsigned long)&enc));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// read_encoder - Read the position of a quadrature encoder.
+//
+// Description:		This function returns the signed position and error
+//					count of an encoder set up with set_encoder(). It
+//					does this by calling the UIO48 device drivers
+//					IOCTL_GET_ENCODER method.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			index		The encoder number
+//			position	Receives the position, four counts per cycle
+//			errors		Receives the error count (may be NULL)
+//
+// Returns:
+//			-1		If the chip does not exist or it's handle is invalid
+//	or		The result of the IOCTL_GET_ENCODER call
+//
+//------------------------------------------------------------------------
+//
+int read_encoder(int chip_number, int index, long long *position,
+				 unsigned *errors)
+{
+	struct uio48_encoder enc;
+	int c;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	enc.index = index;
+
+	c = backend->ioctl(handle[chip_number-1], IOCTL_GET_ENCODER, (unsigned long)&enc);
+
+	if(c == 0)
+	{
+		*position = enc.position;
+
+		if(errors)
+			*errors = enc.errors;
+	}
+
+	return c;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// read_state - Take a consistent snapshot of the driver state.
+//
+// Description:		This function copies the drivers read-only state page
+//					(output, lock, enable and polarity images, the last
+//					input snapshot, per-bit event counts and encoder
+//					positions) without a system call once the page has
+//					been mapped. The copy is retried while the driver is
+//					updating the page.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			state		Receives the snapshot
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or the page cannot be mapped
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int read_state(int chip_number, struct uio48_state *state)
+{
+	const volatile struct uio48_state *page, *expected = NULL;
+	void *p;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	page = __atomic_load_n(&state_page[chip_number-1], __ATOMIC_ACQUIRE);
+
+	// Map the page the first time through. If another thread got there
+	// first use its mapping and drop ours.
+	if(page == NULL)
+	{
+		p = backend->mmap(handle[chip_number-1], 4096, PROT_READ, 0);
+
+		if(p == MAP_FAILED)
+			return -1;
+
+		if(__atomic_compare_exchange_n(&state_page[chip_number-1], &expected,
+				p, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			page = p;
+		else
+		{
+			backend->munmap(p, 4096);
+			page = expected;
+		}
+	}
+
+	copy_state(page, state);
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// batch_init - Start an empty command list.
+//
+// Description:		The batch_xxx functions build a list of operations
+//					that batch_submit() hands to the driver in a single
+//					call. Lists on a chip never interleave with each
+//					other, but single bit, port and interrupt calls from
+//					other users may land between two commands; each
+//					command is only atomic on its own port.
+//
+// Arguments:
+//			batch		The command list
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			Nothing
+//
+//------------------------------------------------------------------------
+//
+void batch_init(struct uio48_batch *batch, int chip_number)
+{
+	batch->chip_number = chip_number;
+	batch->count = 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// batch_add - Append one command to a command list.
+//
+// Description:		batch_add() appends a raw UIO48_OP_xxx command. The
+//					remaining batch_xxx functions are shorthands for it
+//					taking the same arguments as their single call
+//					counterparts. After batch_submit() the result of a
+//					command is in batch->cmds[index].result.
+//
+// Arguments:
+//			batch		The command list
+//			op			UIO48_OP_xxx
+//			port		Register offset, port or 1 based bit number
+//			mask		Bits to change for UIO48_OP_WRITE_MASKED
+//			value		Value to write or polarity
+//			arg			Delay in microseconds for UIO48_OP_DELAY
+//
+// Returns:
+//			-1		If the list is full
+//	or		The index of the command in the list
+//
+//------------------------------------------------------------------------
+//
+int batch_add(struct uio48_batch *batch, int op, int port, int mask, int value,
+			  unsigned arg)
+{
+	struct uio48_cmd *cmd;
+
+	if(batch->count >= UIO48_MAX_CMDS)
+		return -1;
+
+	cmd = &batch->cmds[batch->count];
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = op;
+	cmd->port = port;
+	cmd->mask = mask;
+	cmd->value = value;
+	cmd->arg = arg;
+
+	return batch->count++;
+}
+
+int batch_read_port(struct uio48_batch *batch, int port_number)
+{
+	return batch_add(batch, UIO48_OP_READ_PORT, port_number, 0, 0, 0);
+}
+
+int batch_write_port(struct uio48_batch *batch, int port_number, int val)
+{
+	return batch_add(batch, UIO48_OP_WRITE_PORT, port_number, 0xff, val, 0);
+}
+
+int batch_write_masked(struct uio48_batch *batch, int port_number, int mask,
+					   int val)
+{
+	return batch_add(batch, UIO48_OP_WRITE_MASKED, port_number, mask, val, 0);
+}
+
+int batch_read_bit(struct uio48_batch *batch, int bit_number)
+{
+	return batch_add(batch, UIO48_OP_READ_BIT, bit_number, 0, 0, 0);
+}
+
+int batch_set_bit(struct uio48_batch *batch, int bit_number)
+{
+	return batch_add(batch, UIO48_OP_SET_BIT, bit_number, 0, 0, 0);
+}
+
+int batch_clr_bit(struct uio48_batch *batch, int bit_number)
+{
+	return batch_add(batch, UIO48_OP_CLR_BIT, bit_number, 0, 0, 0);
+}
+
+int batch_enab_int(struct uio48_batch *batch, int bit_number, int polarity)
+{
+	return batch_add(batch, UIO48_OP_ENAB_INT, bit_number, 0, polarity, 0);
+}
+
+int batch_disab_int(struct uio48_batch *batch, int bit_number)
+{
+	return batch_add(batch, UIO48_OP_DISAB_INT, bit_number, 0, 0, 0);
+}
+
+int batch_lock_port(struct uio48_batch *batch, int port_number)
+{
+	return batch_add(batch, UIO48_OP_LOCK_PORT, port_number, 0, 0, 0);
+}
+
+int batch_unlock_port(struct uio48_batch *batch, int port_number)
+{
+	return batch_add(batch, UIO48_OP_UNLOCK_PORT, port_number, 0, 0, 0);
+}
+
+int batch_delay(struct uio48_batch *batch, unsigned usecs)
+{
+	return batch_add(batch, UIO48_OP_DELAY, 0, 0, 0, usecs);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// batch_submit - Execute a command list.
+//
+// Description:		The commands are run in order. Execution stops at the
+//					first failing command and the commands after it are
+//					marked -ECANCELED. The list is left intact so it can
+//					be submitted again.
+//
+// Arguments:
+//			batch		The command list
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid
+//					or a command failed
+//	or		0		If every command succeeded
+//
+//------------------------------------------------------------------------
+//
+int batch_submit(struct uio48_batch *batch)
+{
+	struct uio48_cmd_list list;
+
+    if(check_handle(batch->chip_number-1))	// Check for chip available
+		return(-1);							// Return -1 if not
+
+	list.version = UIO48_CMD_VERSION;
+	list.count = batch->count;
+	list.cmds = (unsigned long)batch->cmds;
+
+	return backend->ioctl(handle[batch->chip_number-1], IOCTL_CMD_LIST, (unsigned long)&list);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// begin_transaction - Start recording output writes.
+//
+// Description:		Until commit_transaction() or abort_transaction() is
+//					called, write_bit(), set_bit(), clr_bit() and
+//					write_byte() to ports 0-5 of this chip only update a
+//					copy of the output port images held by the calling
+//					thread. Writes to other registers go straight to the
+//					driver.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid,
+//					the state page cannot be mapped or a transaction is
+//					already open
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int begin_transaction(int chip_number)
+{
+	struct uio48_txn *t;
+	struct uio48_state state;
+	int port;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	t = &txn[chip_number-1];
+
+	if(t->active)
+		return -1;
+
+	// Start from the drivers view of the outputs. The state page misses
+	// writes made by the direct backend, the shared images do not.
+	if(direct[chip_number-1].images)
+	{
+		for(port = 0; port < 6; port++)
+			state.port_images[port] =
+				__atomic_load_n(&direct[chip_number-1].images[port], __ATOMIC_ACQUIRE);
+	}
+	else if(read_state(chip_number, &state))
+		return -1;
+
+	memcpy(t->base, state.port_images, sizeof(t->base));
+	memcpy(t->image, state.port_images, sizeof(t->image));
+	t->active = 1;
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// commit_transaction - Write the recorded outputs.
+//
+// Description:		Only the bits that differ from the images captured by
+//					begin_transaction() are written, as one masked write
+//					per changed port, and all of them go to the driver in
+//					a single IOCTL_CMD_LIST call. Bits the transaction did
+//					not change keep whatever value they have meanwhile.
+//					Nothing is sent when nothing changed.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			-1		If the chip does not exist, it's handle is invalid,
+//					no transaction is open or the write failed
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int commit_transaction(int chip_number)
+{
+	struct uio48_txn *t;
+	struct uio48_cmd cmds[6];
+	struct uio48_cmd_list list;
+	int port, mask;
+
+    if(check_handle(chip_number-1))		// Check for chip available
+		return(-1);						// Return -1 if not
+
+	t = &txn[chip_number-1];
+
+	if(!t->active)
+		return -1;
+
+	t->active = 0;
+
+	memset(cmds, 0, sizeof(cmds));
+	list.count = 0;
+
+	for(port = 0; port < 6; port++)
+	{
+		mask = t->image[port] ^ t->base[port];
+
+		if(mask == 0)
+			continue;
+
+		cmds[list.count].op = UIO48_OP_WRITE_MASKED;
+		cmds[list.count].port = port;
+		cmds[list.count].mask = mask;
+		cmds[list.count].value = t->image[port];
+		list.count++;
+	}
+
+	if(list.count == 0)
+		return 0;
+
+	list.version = UIO48_CMD_VERSION;
+	list.cmds = (unsigned long)cmds;
+
+	return backend->ioctl(handle[chip_number-1], IOCTL_CMD_LIST, (unsigned long)&list);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// abort_transaction - Discard the recorded outputs.
+//
+// Description:		This function closes the transaction without writing
+//					anything to the chip.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			-1		If the chip number is out of range or no transaction
+//					is open
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int abort_transaction(int chip_number)
+{
+	if(chip_number < 1 || chip_number > MAX_CHIPS)
+		return -1;
+
+	if(!txn[chip_number-1].active)
+		return -1;
+
+	txn[chip_number-1].active = 0;
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_open - Open a context for a chip.
+//
+// Description:		A context owns its own file descriptor and mapping of
+//					the drivers state page, so threads that each open a
+//					context share no library state. The uio48_xxx
+//					functions taking a context behave like the legacy
+//					functions of the same name without the check_handle()
+//					lookup on every call.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			NULL	If the chip does not exist or cannot be opened
+//	or		The new context
+//
+//------------------------------------------------------------------------
+//
+struct uio48_ctx *uio48_open(int chip_number)
+{
+	struct uio48_ctx *ctx;
+	void *p;
+
+	if(chip_number < 1 || chip_number > MAX_CHIPS)
+		return NULL;
+
+	ctx = calloc(1, sizeof(*ctx));
+
+	if(ctx == NULL)
+		return NULL;
+
+	ctx->chip_number = chip_number;
+	ctx->fd = get_backend()->open(chip_number-1);
+
+	if(ctx->fd < 0)
+	{
+		free(ctx);
+		return NULL;
+	}
+
+	// The state page is optional, older drivers do not offer it
+	p = backend->mmap(ctx->fd, 4096, PROT_READ, 0);
+
+	if(p != MAP_FAILED)
+		ctx->state = p;
+
+	direct_open(ctx->fd, &ctx->direct);
+
+	return ctx;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_close - Release a context.
+//
+// Arguments:
+//			ctx			A context from uio48_open()
+//
+// Returns:
+//			Nothing
+//
+//------------------------------------------------------------------------
+//
+void uio48_close(struct uio48_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	if(ctx->state)
+		backend->munmap((void *)ctx->state, 4096);
+
+	if(ctx->direct.images)
+		backend->munmap(ctx->direct.images, 4096);
+
+	backend->close(ctx->fd);
+	free(ctx);
+}
+
+int uio48_read_bit(struct uio48_ctx *ctx, int bit_number)
+{
+	struct uio48_direct *d;
+
+	if((d = direct_bit(ctx->chip_number-1, &ctx->direct, bit_number)))
+		return (direct_read(d, (bit_number-1) / 8) >> ((bit_number-1) % 8)) & 1;
+
+	return backend->ioctl(ctx->fd, IOCTL_READ_BIT, bit_number);
+}
+
+int uio48_write_bit(struct uio48_ctx *ctx, int bit_number, int val)
+{
+	struct uio48_direct *d;
+
+	if((d = direct_bit(ctx->chip_number-1, &ctx->direct, bit_number)))
+		return direct_write(d, (bit_number-1) / 8, 1 << ((bit_number-1) % 8),
+							val ? 0xff : 0);
+
+	return backend->ioctl(ctx->fd, IOCTL_WRITE_BIT, bit_number << 8 | val);
+}
+
+int uio48_set_bit(struct uio48_ctx *ctx, int bit_number)
+{
+	return uio48_write_bit(ctx, bit_number, 1);
+}
+
+int uio48_clr_bit(struct uio48_ctx *ctx, int bit_number)
+{
+	return uio48_write_bit(ctx, bit_number, 0);
+}
+
+int uio48_read_byte(struct uio48_ctx *ctx, int port_number)
+{
+	struct uio48_direct *d;
+
+	if((d = direct_port(ctx->chip_number-1, &ctx->direct, port_number)))
+		return direct_read(d, port_number);
+
+	return backend->ioctl(ctx->fd, IOCTL_READ_PORT, port_number);
+}
+
+int uio48_write_byte(struct uio48_ctx *ctx, int port_number, int val)
+{
+	struct uio48_direct *d;
+
+	if((d = direct_port(ctx->chip_number-1, &ctx->direct, port_number)))
+		return direct_write(d, port_number, 0xff, val);
+
+	return backend->ioctl(ctx->fd, IOCTL_WRITE_PORT, (port_number << 8) | val);
+}
+
+int uio48_enab_int(struct uio48_ctx *ctx, int bit_number, int polarity)
+{
+	return backend->ioctl(ctx->fd, IOCTL_ENAB_INT, bit_number << 8 | polarity);
+}
+
+int uio48_disab_int(struct uio48_ctx *ctx, int bit_number)
+{
+	return backend->ioctl(ctx->fd, IOCTL_DISAB_INT, bit_number);
+}
+
+int uio48_clr_int(struct uio48_ctx *ctx, int bit_number)
+{
+	return backend->ioctl(ctx->fd, IOCTL_CLR_INT, bit_number);
+}
+
+int uio48_get_int(struct uio48_ctx *ctx)
+{
+	return backend->ioctl(ctx->fd, IOCTL_GET_INT, 0);
+}
+
+int uio48_wait_int(struct uio48_ctx *ctx)
+{
+	return backend->ioctl(ctx->fd, IOCTL_WAIT_INT, 0);
+}
+
+int uio48_read_events(struct uio48_ctx *ctx, struct uio48_event *events,
+					  int max_events)
+{
+	ssize_t c;
+
+	c = backend->read(ctx->fd, events, max_events * sizeof(struct uio48_event));
+
+	if(c < 0)
+		return -1;
+
+	return c / sizeof(struct uio48_event);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_submit - Execute a command list on a context.
+//
+// Description:		Unlike batch_submit(), the chip_number recorded in the
+//					batch is ignored in favour of the context.
+//
+// Arguments:
+//			ctx			A context from uio48_open()
+//			batch		The command list
+//
+// Returns:
+//			-1		If a command failed
+//	or		0		If every command succeeded
+//
+//------------------------------------------------------------------------
+//
+int uio48_submit(struct uio48_ctx *ctx, struct uio48_batch *batch)
+{
+	struct uio48_cmd_list list;
+
+	list.version = UIO48_CMD_VERSION;
+	list.count = batch->count;
+	list.cmds = (unsigned long)batch->cmds;
+
+	return backend->ioctl(ctx->fd, IOCTL_CMD_LIST, (unsigned long)&list);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_read_state - Take a consistent snapshot of the driver state.
+//
+// Description:		Reads the page mapped by uio48_open(), see
+//					read_state().
+//
+// Arguments:
+//			ctx			A context from uio48_open()
+//			state		Receives the snapshot
+//
+// Returns:
+//			-1		If the state page is not mapped
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int uio48_read_state(struct uio48_ctx *ctx, struct uio48_state *state)
+{
+	if(ctx->state == NULL)
+		return -1;
+
+	copy_state(ctx->state, state);
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// txn_write - Record a write in the open transaction.
+//
+// Description:
+//
+// Arguments:
+//			chip		The 0 based index of the chip
+//			port		The output port, 0 to 5
+//			mask		The bits to change
+//			val			The new value of those bits
+//
+// Returns:
+//			0		Always
+//
+//------------------------------------------------------------------------
+//
+static int txn_write(int chip, int port, int mask, int val)
+{
+	struct uio48_txn *t = &txn[chip];
+
+	t->image[port] = (t->image[port] & ~mask) | (val & mask);
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// txn_write_bit - Record a bit write in the open transaction.
+//
+// Description:
+//
+// Arguments:
+//			chip		The 0 based index of the chip
+//			bit_number	The 1 based index of the bit
+//			val			The value to write to the bit (0 or 1)
+//
+// Returns:
+//			-1		If the bit number is out of range
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+static int txn_write_bit(int chip, int bit_number, int val)
+{
+	if(bit_number < 1 || bit_number > 48)
+		return -1;
+
+	--bit_number;
+
+	return txn_write(chip, bit_number / 8, 1 << (bit_number % 8), val ? 0xff : 0);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48_set_backend - Choose the register backend.
+//
+// Description:		Has to be called before the first chip is opened, the
+//					backend cannot change afterwards. Applications that
+//					do not call it get the one named by UIO48_BACKEND.
+//
+// Arguments:
+//			be			uio48_kernel_backend, uio48_direct_backend,
+//						uio48_sim_backend or an application backend
+//
+// Returns:
+//			-1		If a backend is already in use
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int uio48_set_backend(const struct uio48_backend *be)
+{
+	const struct uio48_backend *expected = NULL;
+
+	if(!__atomic_compare_exchange_n(&backend, &expected, be, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return -1;
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// get_backend - Return the register backend, choosing it on first use.
+//
+// Arguments:
+//			None
+//
+// Returns:
+//			The backend
+//
+//------------------------------------------------------------------------
+//
+static const struct uio48_backend *get_backend(void)
+{
+	const struct uio48_backend *be, *expected = NULL;
+	char *name;
+
+	be = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+
+	if(be)
+		return be;
+
+	name = getenv("UIO48_BACKEND");
+
+	if(name && !strcmp(name, "direct"))
+		be = &uio48_direct_backend;
+	else if(name && !strcmp(name, "sim") && &uio48_sim_backend)
+		be = &uio48_sim_backend;
+	else
+		be = &uio48_kernel_backend;
+
+	// Racing threads all pick the same one, keep the first
+	if(!__atomic_compare_exchange_n(&backend, &expected, be, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		be = expected;
+
+	return be;
+}
+
+// The kernel driver backend, also the base of the direct backend
+static int kernel_open(int chip)
+{
+	return open(device_id[chip], O_RDWR | O_CLOEXEC);
+}
+
+static int kernel_ioctl(int handle, unsigned long request, unsigned long arg)
+{
+	return ioctl(handle, request, arg);
+}
+
+static void *kernel_mmap(int handle, size_t len, int prot, off_t offset)
+{
+	return mmap(NULL, len, prot, MAP_SHARED, handle, offset);
+}
+
+const struct uio48_backend uio48_kernel_backend = {
+	.name = "kernel",
+	.open = kernel_open,
+	.close = close,
+	.ioctl = kernel_ioctl,
+	.read = read,
+	.mmap = kernel_mmap,
+	.munmap = munmap,
+};
+
+const struct uio48_backend uio48_direct_backend = {
+	.name = "direct",
+	.direct = 1,
+	.open = kernel_open,
+	.close = close,
+	.ioctl = kernel_ioctl,
+	.read = read,
+	.mmap = kernel_mmap,
+	.munmap = munmap,
+};
+
+//
+//------------------------------------------------------------------------
+//
+// direct_open - Set up direct port I/O for an open device.
+//
+// Description:		With the direct backend selected, reads of
+//					ports 0-5 and writes of output bits and ports 0-5 use
+//					inb()/outb() instead of the driver. Output writes go
+//					through the image words the driver shares at mmap
+//					offset 4096 so neither side loses the others changes.
+//					Anything that fails here, typically for lack of
+//					CAP_SYS_RAWIO, leaves the device on the driver path.
+//
+// Arguments:
+//			fd			The open device
+//			d			Receives the backend state
+//
+// Returns:
+//			-1		If the direct backend is not used
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+static int direct_open(int fd, struct uio48_direct *d)
+{
+#ifdef HAVE_PORT_IO
+	struct uio48_info info;
+	void *p;
+
+	if(!backend->direct)
+		return -1;
+
+	if(backend->ioctl(fd, IOCTL_GET_INFO, (unsigned long)&info) || info.base_port == 0)
+		return -1;
+
+	p = backend->mmap(fd, 4096, PROT_READ | PROT_WRITE, 4096);
+
+	if(p == MAP_FAILED)
+		return -1;
+
+	d->base_port = info.base_port;
+	__atomic_store_n(&d->images, p, __ATOMIC_RELEASE);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+//
+//------------------------------------------------------------------------
+//
+// direct_port - Decide whether a port is accessed directly.
+//
+// Description:		The first direct access from a thread requests the
+//					port range with ioperm() for that thread.
+//
+// Arguments:
+//			chip		The 0 based index of the chip
+//			d			The backend state
+//			port		The register offset
+//
+// Returns:
+//			NULL	If the access has to go through the driver
+//	or		d
+//
+//------------------------------------------------------------------------
+//
+static struct uio48_direct *direct_port(int chip, struct uio48_direct *d,
+										int port)
+{
+#ifdef HAVE_PORT_IO
+	if(port < 0 || port > 5)
+		return NULL;
+
+	if(__atomic_load_n(&d->images, __ATOMIC_ACQUIRE) == NULL)
+		return NULL;
+
+	if(io_granted[chip] == 0)
+		io_granted[chip] = ioperm(d->base_port, 6, 1) ? 2 : 1;
+
+	if(io_granted[chip] == 1)
+		return d;
+#endif
+	return NULL;
+}
+
+static struct uio48_direct *direct_bit(int chip, struct uio48_direct *d,
+									   int bit_number)
+{
+	if(bit_number < 1 || bit_number > 48)
+		return NULL;
+
+	return direct_port(chip, d, (bit_number-1) / 8);
+}
+
+static int direct_read(struct uio48_direct *d, int port)
+{
+#ifdef HAVE_PORT_IO
+	return inb(d->base_port + port);
+#else
+	return -1;
+#endif
+}
+
+//
+//------------------------------------------------------------------------
+//
+// direct_write - Update bits of an output port directly.
+//
+// Description:		The change is merged into the shared image word with
+//					a compare-and-swap. The word is then written to the
+//					port, and written again if another writer, the driver
+//					included, changed it meanwhile. Whoever changes the
+//					image last therefore also gets the last write.
+//
+// Arguments:
+//			d			The backend state
+//			port		The output port, 0 to 5
+//			mask		The bits to change
+//			val			The new value of those bits
+//
+// Returns:
+//			0		Always
+//
+//------------------------------------------------------------------------
+//
+static int direct_write(struct uio48_direct *d, int port, int mask, int val)
+{
+#ifdef HAVE_PORT_IO
+	unsigned *img = &d->images[port];
+	unsigned old, temp;
+
+	old = __atomic_load_n(img, __ATOMIC_RELAXED);
+
+	do
+		temp = (old & ~mask) | (val & mask);
+	while(!__atomic_compare_exchange_n(img, &old, temp, 0, __ATOMIC_SEQ_CST,
+									   __ATOMIC_RELAXED));
+
+	do
+	{
+		temp = __atomic_load_n(img, __ATOMIC_SEQ_CST);
+		outb(temp, d->base_port + port);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	} while(temp != __atomic_load_n(img, __ATOMIC_SEQ_CST));
+#endif
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// copy_state - Copy the state page under its sequence count.
+//
+// Description:		The copy is retried while the driver is updating the
+//					page.
+//
+// Arguments:
+//			page		The mapped state page
+//			state		Receives the snapshot
+//
+// Returns:
+//			Nothing
+//
+//------------------------------------------------------------------------
+//
+static void copy_state(const volatile struct uio48_state *page,
+					   struct uio48_state *state)
+{
+	unsigned seq;
+
+	do
+	{
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+		memcpy(state, (const void *)page, sizeof(*state));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+}
+
+//
+//------------------------------------------------------------------------
+//
+// check_handle - Checks that a handle to the appropriate device file
+//					exists. If it does not a file open is performed.
+//
+// Description:		Safe to call from several threads at once. Each racing
+//					thread may open the device, but only the first handle
+//					is published and the others are closed again.
+//
+// Arguments:
+//			chip_number	The 0 based index of the chip
+//
+// Returns:
+//			0		if handle is valid
+//			-1		If the chip does not exist or it's handle is invalid
+//
+//------------------------------------------------------------------------
+//
+int check_handle(int chip_number)
+{
+	int fd, expected = 0;
+
+	if(chip_number < 0 || chip_number >= MAX_CHIPS)
+		return -1;
+
+	fd = __atomic_load_n(&handle[chip_number], __ATOMIC_ACQUIRE);
+
+    if(fd > 0)	// If it's already a valid handle
+		return 0;
+
+    if(fd == -1)	// If it's already been tried
+		return -1;
+
+	// Try opening the device file, in case it hasn't been opened yet
+    fd = get_backend()->open(chip_number);
+
+	if(fd <= 0)
+		fd = -1;
+
+	// Publish our result unless another thread beat us to it
+	if(!__atomic_compare_exchange_n(&handle[chip_number], &expected, fd, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		if(fd > 0)
+			backend->close(fd);
+
+		fd = expected;
+	}
+	else if(fd > 0)
+		direct_open(fd, &direct[chip_number]);
+
+    if(fd > 0)	// If it's now a validopen handle
+		return 0;
+
+	return -1;
 }
@@ -0,0 +1,1280 @@
+///****************************************************************************
+//
+//	Copyright 2011 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+///****************************************************************************
+//
+//	Name	 : uio48sim.c
+//
+//	Project	 : UIO48 Linux Device Driver
+//
+//	A software model of the UIO48 register map and of the driver on top
+//	of it, used by the user library when UIO48_BACKEND=sim. Nothing here
+//	touches hardware, so applications and benchmarks built against the
+//	library run unmodified on a machine without a card.
+//
+//	The register model covers:
+//		+0..+5		I/O ports. Reads return the output latch ORed with the
+//					level injected on the pin, writes are ignored while
+//					the port is locked
+//		+6			Interrupt pending, one bit per port 0-2
+//		+7			Page (bits 6-7) and port lock (bits 0-5)
+//		+8..+0x0a	Page 1 polarity, page 2 enable, page 3 interrupt ID
+//
+//	An enabled bit of ports 0-2 latches its interrupt ID on an edge to
+//	the selected polarity and the model then runs the same service
+//	sequence as the drivers interrupt handler. Ports 3-5 are checked for
+//	change-of-state on every pin change, like the drivers sampler with a
+//	zero period.
+//
+///****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>   /* mmap */
+#include <sys/stat.h>
+
+// Include the WinSystems UIO48 definitions
+#include "uio48.h"
+
+// Page defintions
+#define PAGE0		0x0
+#define PAGE1		0x40
+#define PAGE2		0x80
+#define PAGE3		0xc0
+
+// Size of the event ring, as in the driver
+#define MAX_INTS	1024
+
+struct sim_chip {
+	pthread_mutex_t lock;
+	pthread_cond_t wq;				// event queued
+
+	// registers
+	unsigned char latch[6];			// output latches
+	unsigned char input[6];			// levels injected on the pins
+	unsigned char page_lock;		// +7
+	unsigned char pol[3];			// page 1
+	unsigned char enab[3];			// page 2
+	unsigned char int_id[3];		// page 3
+
+	// driver model
+	unsigned char cos_pol[3];		// change-of-state on ports 3-5
+	unsigned char cos_enab[3];
+	struct uio48_event ring[MAX_INTS];
+	int inptr;
+	int outptr;
+	int exclusive;					// UIO48_WAIT_EXCLUSIVE
+	struct uio48_state *state;
+
+	// waveform player
+	pthread_t player;
+	int playing;
+	int stop;
+	pthread_cond_t player_cv;
+	struct uio48_wave_step *steps;
+	int count;
+	int loops;
+};
+
+static struct sim_chip chips[MAX_CHIPS];
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+
+static void sim_init(void);
+static unsigned char sim_pins(struct sim_chip *c, int port);
+static void sim_set_pins(struct sim_chip *c, int port, unsigned char old);
+static unsigned sim_inb(struct sim_chip *c, int reg);
+static void sim_outb(struct sim_chip *c, unsigned val, int reg);
+static void sim_irq(struct sim_chip *c);
+static void sim_queue(struct sim_chip *c, int bit_number, int flags);
+static void sim_publish(struct sim_chip *c);
+static unsigned long long sim_now(void);
+static int sim_cmd(struct sim_chip *c, struct uio48_cmd *cmd);
+static void *sim_player(void *arg);
+
+///**********************************************************************
+//			REGISTER MODEL
+///**********************************************************************
+
+static void sim_init(void)
+{
+	pthread_condattr_t attr;
+	int x;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	for(x = 0; x < MAX_CHIPS; x++)
+	{
+		pthread_mutex_init(&chips[x].lock, NULL);
+		pthread_cond_init(&chips[x].wq, NULL);
+		pthread_cond_init(&chips[x].player_cv, &attr);
+
+		// The state page mirrors the drivers read-only mapping
+		chips[x].state = aligned_alloc(4096, 4096);
+
+		if(chips[x].state)
+			memset(chips[x].state, 0, 4096);
+
+		// Power up on page 3, as the driver leaves the chip
+		chips[x].page_lock = PAGE3;
+	}
+
+	pthread_condattr_destroy(&attr);
+}
+
+// The level the chip reads back from a port
+static unsigned char sim_pins(struct sim_chip *c, int port)
+{
+	return c->latch[port] | c->input[port];
+}
+
+// Detect edges after the pins of a port may have changed from old
+static void sim_set_pins(struct sim_chip *c, int port, unsigned char old)
+{
+	unsigned char now = sim_pins(c, port);
+	unsigned char rise = now & ~old;
+	unsigned char fall = old & ~now;
+	unsigned char edges;
+	int j;
+
+	if(now == old)
+		return;
+
+	if(c->state)
+		c->state->input_timestamp = sim_now();
+
+	if(port < 3)
+	{
+		// Latch the interrupt ID of enabled bits that saw their edge
+		edges = ((rise & c->pol[port]) | (fall & ~c->pol[port])) & c->enab[port];
+
+		if(edges)
+		{
+			c->int_id[port] |= edges;
+			sim_irq(c);
+		}
+
+		return;
+	}
+
+	// Change-of-state sampling of ports 3-5
+	edges = ((rise & c->cos_pol[port-3]) | (fall & ~c->cos_pol[port-3])) &
+			c->cos_enab[port-3];
+
+	for(j = 0; j < 8; j++)
+	{
+		if((edges >> j) & 1)
+			sim_queue(c, port * 8 + j + 1, ((rise >> j) & 1) ?
+					  UIO48_EVENT_RISING : UIO48_EVENT_FALLING);
+	}
+}
+
+static unsigned sim_inb(struct sim_chip *c, int reg)
+{
+	int i;
+	unsigned val = 0;
+
+	if(reg < 6)
+		return sim_pins(c, reg);
+
+	if(reg == 6)
+	{
+		for(i = 0; i < 3; i++)
+			if(c->int_id[i])
+				val |= 1 << i;
+
+		return val;
+	}
+
+	if(reg == 7)
+		return c->page_lock;
+
+	if(reg > 0x0a)
+		return 0;
+
+	switch(c->page_lock & 0xc0)
+	{
+	case PAGE1:
+		return c->pol[reg - 8];
+
+	case PAGE2:
+		return c->enab[reg - 8];
+
+	case PAGE3:
+		return c->int_id[reg - 8];
+	}
+
+	return 0;
+}
+
+static void sim_outb(struct sim_chip *c, unsigned val, int reg)
+{
+	unsigned char old;
+
+	val &= 0xff;
+
+	if(reg < 6)
+	{
+		if((c->page_lock >> reg) & 1)
+			return;
+
+		old = sim_pins(c, reg);
+		c->latch[reg] = val;
+		sim_set_pins(c, reg, old);
+		return;
+	}
+
+	if(reg == 7)
+	{
+		c->page_lock = val;
+		return;
+	}
+
+	if(reg < 8 || reg > 0x0a)
+		return;
+
+	switch(c->page_lock & 0xc0)
+	{
+	case PAGE1:
+		c->pol[reg - 8] = val;
+		break;
+
+	case PAGE2:
+		// Disabling a bit also drops its latched interrupt
+		c->enab[reg - 8] = val;
+		c->int_id[reg - 8] &= val;
+		break;
+
+	case PAGE3:
+		// Writing a 0 clears the interrupt ID bit
+		c->int_id[reg - 8] &= val;
+		break;
+	}
+}
+
+///**********************************************************************
+//			DRIVER MODEL
+///**********************************************************************
+
+// The drivers interrupt handler, called with the chip lock held
+static void sim_irq(struct sim_chip *c)
+{
+	unsigned pending, id;
+	int i, j;
+
+	pending = sim_inb(c, 6) & 0x07;
+
+	for(i = 0; i < 3; i++)
+	{
+		if(!((pending >> i) & 1))
+			continue;
+
+		id = sim_inb(c, 8 + i);
+		sim_outb(c, 0, 8 + i);
+
+		for(j = 0; j < 8; j++)
+		{
+			if((id >> j) & 1)
+				sim_queue(c, i * 8 + j + 1, ((c->pol[i] >> j) & 1) ?
+						  UIO48_EVENT_RISING : UIO48_EVENT_FALLING);
+		}
+	}
+}
+
+// Queue an event record, dropping the oldest one when the ring is full
+static void sim_queue(struct sim_chip *c, int bit_number, int flags)
+{
+	struct uio48_event *ev = &c->ring[c->inptr];
+
+	memset(ev, 0, sizeof(*ev));
+	ev->timestamp = sim_now();
+	ev->bit = bit_number;
+	ev->chip = c - chips;
+	ev->flags = flags;
+
+	c->inptr = (c->inptr + 1) & (MAX_INTS - 1);
+
+	if(c->inptr == c->outptr)
+	{
+		c->outptr = (c->outptr + 1) & (MAX_INTS - 1);
+
+		if(c->state)
+			c->state->overruns++;
+	}
+
+	if(c->state)
+		c->state->bit_counts[bit_number - 1]++;
+
+	// one exclusive waiter per event, as in the driver
+	if(c->exclusive)
+		pthread_cond_signal(&c->wq);
+	else
+		pthread_cond_broadcast(&c->wq);
+}
+
+static int sim_get_event(struct sim_chip *c, struct uio48_event *ev)
+{
+	if(c->outptr == c->inptr)
+		return 0;
+
+	*ev = c->ring[c->outptr];
+	c->outptr = (c->outptr + 1) & (MAX_INTS - 1);
+
+	return 1;
+}
+
+// Refresh the state page, called with the chip lock held
+static void sim_publish(struct sim_chip *c)
+{
+	struct uio48_state *s = c->state;
+	int i;
+
+	if(s == NULL)
+		return;
+
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(i = 0; i < 6; i++)
+	{
+		s->port_images[i] = c->latch[i];
+		s->input_image[i] = sim_pins(c, i);
+		s->enab_image[i] = i < 3 ? c->enab[i] : c->cos_enab[i - 3];
+		s->pol_image[i] = i < 3 ? c->pol[i] : c->cos_pol[i - 3];
+	}
+
+	s->lock_image = c->page_lock & 0x3f;
+
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned long long sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sim_write_port(struct sim_chip *c, int port, unsigned mask,
+						   unsigned val)
+{
+	sim_outb(c, (c->latch[port] & ~mask) | (val & mask), port);
+}
+
+// Page in a bank, read-modify-write it and go back to page 3
+static void sim_update_paged(struct sim_chip *c, int page, int port,
+							 unsigned mask, unsigned val)
+{
+	unsigned lock = c->page_lock & 0x3f;
+
+	sim_outb(c, page | lock, 7);
+	sim_outb(c, (sim_inb(c, 8 + port) & ~mask) | (val & mask), 8 + port);
+	sim_outb(c, PAGE3 | lock, 7);
+}
+
+static void sim_enab_int(struct sim_chip *c, int bit_number, int polarity)
+{
+	unsigned mask;
+
+	--bit_number;
+	mask = 1 << (bit_number % 8);
+
+	if(bit_number >= 24)
+	{
+		c->cos_pol[bit_number / 8 - 3] = (c->cos_pol[bit_number / 8 - 3] & ~mask) |
+										 (polarity ? mask : 0);
+		c->cos_enab[bit_number / 8 - 3] |= mask;
+		return;
+	}
+
+	sim_update_paged(c, PAGE1, bit_number / 8, mask, polarity ? mask : 0);
+	sim_update_paged(c, PAGE2, bit_number / 8, mask, mask);
+}
+
+static void sim_disab_int(struct sim_chip *c, int bit_number)
+{
+	unsigned mask;
+
+	--bit_number;
+	mask = 1 << (bit_number % 8);
+
+	if(bit_number >= 24)
+	{
+		c->cos_enab[bit_number / 8 - 3] &= ~mask;
+		return;
+	}
+
+	sim_update_paged(c, PAGE2, bit_number / 8, mask, 0);
+}
+
+static void sim_clr_int(struct sim_chip *c, int bit_number)
+{
+	unsigned mask;
+
+	if(bit_number > 24)
+		return;
+
+	--bit_number;
+	mask = 1 << (bit_number % 8);
+
+	// Toggling the enable clears the interrupt, as in the driver
+	sim_update_paged(c, PAGE2, bit_number / 8, mask, 0);
+	sim_update_paged(c, PAGE2, bit_number / 8, mask, mask);
+}
+
+static int valid_bit(int bit_number)
+{
+	return bit_number >= 1 && bit_number <= 48;
+}
+
+// One command of a command list, called with the chip lock held
+static int sim_cmd(struct sim_chip *c, struct uio48_cmd *cmd)
+{
+	struct timespec ts;
+	unsigned mask;
+
+	switch(cmd->op)
+	{
+	case UIO48_OP_READ_PORT:
+		if(cmd->port > 0x0f)
+			return -EINVAL;
+		return sim_inb(c, cmd->port);
+
+	case UIO48_OP_WRITE_PORT:
+	case UIO48_OP_WRITE_MASKED:
+		if(cmd->port > 0x0f)
+			return -EINVAL;
+
+		mask = cmd->op == UIO48_OP_WRITE_PORT ? 0xff : cmd->mask;
+
+		if(cmd->port < 6)
+			sim_write_port(c, cmd->port, mask, cmd->value);
+		else
+			sim_outb(c, (sim_inb(c, cmd->port) & ~mask) | (cmd->value & mask),
+					 cmd->port);
+		return 0;
+
+	case UIO48_OP_READ_BIT:
+	case UIO48_OP_SET_BIT:
+	case UIO48_OP_CLR_BIT:
+	case UIO48_OP_ENAB_INT:
+	case UIO48_OP_DISAB_INT:
+		if(!valid_bit(cmd->port))
+			return -EINVAL;
+
+		mask = 1 << ((cmd->port - 1) % 8);
+
+		if(cmd->op == UIO48_OP_READ_BIT)
+			return (sim_inb(c, (cmd->port - 1) / 8) & mask) ? 1 : 0;
+		else if(cmd->op == UIO48_OP_SET_BIT)
+			sim_write_port(c, (cmd->port - 1) / 8, mask, mask);
+		else if(cmd->op == UIO48_OP_CLR_BIT)
+			sim_write_port(c, (cmd->port - 1) / 8, mask, 0);
+		else if(cmd->op == UIO48_OP_ENAB_INT)
+			sim_enab_int(c, cmd->port, cmd->value);
+		else
+			sim_disab_int(c, cmd->port);
+		return 0;
+
+	case UIO48_OP_LOCK_PORT:
+	case UIO48_OP_UNLOCK_PORT:
+		if(cmd->port > 5)
+			return -EINVAL;
+
+		if(cmd->op == UIO48_OP_LOCK_PORT)
+			sim_outb(c, c->page_lock | (1 << cmd->port), 7);
+		else
+			sim_outb(c, c->page_lock & ~(1 << cmd->port), 7);
+		return 0;
+
+	case UIO48_OP_DELAY:
+		if(cmd->arg > UIO48_MAX_DELAY_US)
+			return -EINVAL;
+
+		// Let injected waveforms run while we wait
+		ts.tv_sec = cmd->arg / 1000000;
+		ts.tv_nsec = (cmd->arg % 1000000) * 1000;
+
+		pthread_mutex_unlock(&c->lock);
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&c->lock);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int sim_cmd_list(struct sim_chip *c, struct uio48_cmd_list *list)
+{
+	struct uio48_cmd *cmds = (struct uio48_cmd *)(unsigned long)list->cmds;
+	unsigned i;
+	int ret = 0;
+
+	if(list->version != UIO48_CMD_VERSION)
+		return -EINVAL;
+
+	if(list->count > UIO48_MAX_CMDS)
+		return -E2BIG;
+
+	for(i = 0; i < list->count; i++)
+	{
+		if(ret < 0)
+		{
+			cmds[i].result = -ECANCELED;
+			continue;
+		}
+
+		cmds[i].result = sim_cmd(c, &cmds[i]);
+
+		if(cmds[i].result < 0)
+			ret = cmds[i].result;
+	}
+
+	return ret;
+}
+
+///**********************************************************************
+//			BACKEND OPERATIONS
+///**********************************************************************
+
+// Handles are the 1 based chip number, so they pass check_handle()
+static struct sim_chip *sim_chip(int handle)
+{
+	if(handle < 1 || handle > MAX_CHIPS)
+		return NULL;
+
+	return &chips[handle - 1];
+}
+
+// Set once the UIO48_SIM_REPLAY trace has been started
+static int env_replayed;
+
+// Cancellation cleanup of a thread waiting for events
+static void sim_unlock(void *arg)
+{
+	struct sim_chip *c = arg;
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int sim_open(int chip)
+{
+	const char *path, *speed;
+
+	pthread_once(&sim_once, sim_init);
+
+	// The first open starts the trace named in the environment, if any.
+	// Not a pthread_once(), the replay opens chips itself.
+	if(!__atomic_exchange_n(&env_replayed, 1, __ATOMIC_ACQ_REL) &&
+	   (path = getenv("UIO48_SIM_REPLAY")) != NULL)
+	{
+		speed = getenv("UIO48_SIM_SPEED");
+
+		if(uio48sim_replay(path, speed ? atof(speed) : 1.0, 1) < 0)
+			fprintf(stderr, "uio48sim: cannot replay %s\n", path);
+	}
+
+	if(chip < 0 || chip >= MAX_CHIPS)
+	{
+		errno = ENODEV;
+		return -1;
+	}
+
+	return chip + 1;
+}
+
+static int sim_close(int handle)
+{
+	(void)handle;
+
+	return 0;
+}
+
+static int sim_ioctl(int handle, unsigned long request, unsigned long arg)
+{
+	struct sim_chip *c = sim_chip(handle);
+	struct uio48_event ev;
+	struct uio48_info *info;
+	int port, ret = 0;
+
+	if(c == NULL)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	switch(request)
+	{
+	case IOCTL_READ_PORT:
+		port = arg & 0xff;
+
+		if(port > 0x0f)
+			ret = -EINVAL;
+		else
+			ret = sim_inb(c, port);
+		break;
+
+	case IOCTL_WRITE_PORT:
+		port = (arg >> 8) & 0xff;
+
+		if(port > 0x0f)
+			ret = -EINVAL;
+		else if(port < 6)
+			sim_write_port(c, port, 0xff, arg);
+		else
+			sim_outb(c, arg, port);
+		break;
+
+	case IOCTL_READ_BIT:
+		if(!valid_bit(arg))
+			ret = -EINVAL;
+		else
+			ret = (sim_inb(c, (arg - 1) / 8) >> ((arg - 1) % 8)) & 1;
+		break;
+
+	case IOCTL_WRITE_BIT:
+	case IOCTL_SET_BIT:
+	case IOCTL_CLR_BIT:
+		if(request == IOCTL_WRITE_BIT)
+		{
+			port = (arg >> 8) & 0xff;
+			arg = arg & 0xff;
+		}
+		else
+		{
+			port = arg;
+			arg = request == IOCTL_SET_BIT;
+		}
+
+		if(!valid_bit(port))
+			ret = -EINVAL;
+		else
+			sim_write_port(c, (port - 1) / 8, 1 << ((port - 1) % 8),
+						   arg ? 0xff : 0);
+		break;
+
+	case IOCTL_ENAB_INT:
+		if(!valid_bit((arg >> 8) & 0xff))
+			ret = -EINVAL;
+		else
+			sim_enab_int(c, (arg >> 8) & 0xff, arg & 0xff);
+		break;
+
+	case IOCTL_DISAB_INT:
+	case IOCTL_CLR_INT:
+		if(!valid_bit(arg & 0xff))
+			ret = -EINVAL;
+		else if(request == IOCTL_DISAB_INT)
+			sim_disab_int(c, arg & 0xff);
+		else
+			sim_clr_int(c, arg & 0xff);
+		break;
+
+	case IOCTL_GET_INT:
+		ret = sim_get_event(c, &ev) ? ev.bit : 0;
+		break;
+
+	case IOCTL_WAIT_INT:
+		pthread_cleanup_push(sim_unlock, c);
+
+		while(c->outptr == c->inptr)
+			pthread_cond_wait(&c->wq, &c->lock);
+
+		pthread_cleanup_pop(0);
+
+		ret = sim_get_event(c, &ev) ? ev.bit : 0;
+
+		if(c->exclusive && c->outptr != c->inptr)
+			pthread_cond_signal(&c->wq);
+		break;
+
+	case IOCTL_CLR_INT_ID:
+		if((arg & 0xff) > 2)
+			ret = -EINVAL;
+		else
+			sim_outb(c, 0, 8 + (arg & 0xff));
+		break;
+
+	case IOCTL_LOCK_PORT:
+	case IOCTL_UNLOCK_PORT:
+		if((arg & 0xff) > 5)
+			ret = -EINVAL;
+		else if(request == IOCTL_LOCK_PORT)
+			sim_outb(c, c->page_lock | (1 << (arg & 0xff)), 7);
+		else
+			sim_outb(c, c->page_lock & ~(1 << (arg & 0xff)), 7);
+		break;
+
+	case IOCTL_CMD_LIST:
+		ret = sim_cmd_list(c, (struct uio48_cmd_list *)arg);
+		break;
+
+	case IOCTL_SET_WAIT_MODE:
+		if(arg != UIO48_WAIT_SHARED && arg != UIO48_WAIT_EXCLUSIVE)
+			ret = -EINVAL;
+		else
+			c->exclusive = (arg == UIO48_WAIT_EXCLUSIVE);
+		break;
+
+	case IOCTL_GET_INFO:
+		// No base port, so the direct backend never engages
+		info = (struct uio48_info *)arg;
+		memset(info, 0, sizeof(*info));
+		info->ports = 6;
+		break;
+
+	default:
+		// moderation, patterns, pulses, PWM and encoders are not modelled
+		ret = -ENOTTY;
+		break;
+	}
+
+	sim_publish(c);
+
+	pthread_mutex_unlock(&c->lock);
+
+	if(ret < 0)
+	{
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
+// read() of event records, blocking until at least one is queued
+static ssize_t sim_read(int handle, void *buf, size_t len)
+{
+	struct sim_chip *c = sim_chip(handle);
+	struct uio48_event *evs = buf;
+	size_t n = 0, max = len / sizeof(struct uio48_event);
+
+	if(c == NULL || max == 0)
+	{
+		errno = c ? EINVAL : EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	// A reader cancelled while it waits must not keep the chip locked
+	pthread_cleanup_push(sim_unlock, c);
+
+	while(c->outptr == c->inptr)
+		pthread_cond_wait(&c->wq, &c->lock);
+
+	pthread_cleanup_pop(0);
+
+	while(n < max && sim_get_event(c, &evs[n]))
+		n++;
+
+	// pass the wakeup on if this reader left events behind
+	if(c->exclusive && c->outptr != c->inptr)
+		pthread_cond_signal(&c->wq);
+
+	pthread_mutex_unlock(&c->lock);
+
+	return n * sizeof(struct uio48_event);
+}
+
+static void *sim_mmap(int handle, size_t len, int prot, off_t offset)
+{
+	struct sim_chip *c = sim_chip(handle);
+
+	// Only the read-only state page exists
+	if(c == NULL || c->state == NULL || offset != 0 || len != 4096 ||
+	   (prot & PROT_WRITE))
+	{
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	sim_publish(c);
+	pthread_mutex_unlock(&c->lock);
+
+	return c->state;
+}
+
+static int sim_munmap(void *addr, size_t len)
+{
+	(void)addr;
+	(void)len;
+
+	return 0;
+}
+
+const struct uio48_backend uio48_sim_backend = {
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.ioctl = sim_ioctl,
+	.read = sim_read,
+	.mmap = sim_mmap,
+	.munmap = sim_munmap,
+};
+
+///**********************************************************************
+//			STIMULUS
+///**********************************************************************
+
+//
+//------------------------------------------------------------------------
+//
+// uio48sim_set_inputs - Drive input levels of a simulated chip.
+//
+// Description:		The bits selected by mask take the levels in value,
+//					as read back by the application. Edges raise events
+//					exactly as the hardware and driver would.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			mask		The bits to drive, UIO48_BIT()
+//			value		Their new levels
+//
+// Returns:
+//			-1		If the chip does not exist
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int uio48sim_set_inputs(int chip_number, unsigned long long mask,
+						unsigned long long value)
+{
+	struct sim_chip *c;
+	unsigned char old;
+	int port;
+
+	if(sim_open(chip_number - 1) < 0)
+		return -1;
+
+	c = &chips[chip_number - 1];
+
+	pthread_mutex_lock(&c->lock);
+
+	for(port = 0; port < 6; port++)
+	{
+		unsigned char m = mask >> (port * 8);
+
+		if(m == 0)
+			continue;
+
+		old = sim_pins(c, port);
+		c->input[port] = (c->input[port] & ~m) | ((value >> (port * 8)) & m);
+		sim_set_pins(c, port, old);
+	}
+
+	sim_publish(c);
+
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48sim_get_outputs - Read the output latches of a simulated chip.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			The 48 output latch bits, bit 1 in the least significant bit
+//
+//------------------------------------------------------------------------
+//
+unsigned long long uio48sim_get_outputs(int chip_number)
+{
+	struct sim_chip *c;
+	unsigned long long val = 0;
+	int port;
+
+	if(sim_open(chip_number - 1) < 0)
+		return 0;
+
+	c = &chips[chip_number - 1];
+
+	pthread_mutex_lock(&c->lock);
+
+	for(port = 0; port < 6; port++)
+		val |= (unsigned long long)c->latch[port] << (port * 8);
+
+	pthread_mutex_unlock(&c->lock);
+
+	return val;
+}
+
+static void *sim_player(void *arg)
+{
+	struct sim_chip *c = arg;
+	struct timespec ts;
+	unsigned long long next = sim_now();
+	int loop, i;
+
+	pthread_mutex_lock(&c->lock);
+
+	for(loop = 0; c->loops == 0 || loop < c->loops; loop++)
+	{
+		for(i = 0; i < c->count; i++)
+		{
+			next += c->steps[i].delay_ns;
+			ts.tv_sec = next / 1000000000ULL;
+			ts.tv_nsec = next % 1000000000ULL;
+
+			// Sleep until the step is due or we are told to stop
+			while(!c->stop &&
+				  pthread_cond_timedwait(&c->player_cv, &c->lock, &ts) != ETIMEDOUT)
+				;
+
+			if(c->stop)
+				goto done;
+
+			pthread_mutex_unlock(&c->lock);
+			uio48sim_set_inputs(c - chips + 1, c->steps[i].mask, c->steps[i].value);
+			pthread_mutex_lock(&c->lock);
+		}
+	}
+
+done:
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48sim_play - Play an input waveform into a simulated chip.
+//
+// Description:		A background thread applies the steps in order, each
+//					delay_ns after the previous one, as if by
+//					uio48sim_set_inputs(). Timing is against absolute
+//					deadlines so lateness does not accumulate. A waveform
+//					already playing on the chip is stopped first.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//			steps		The waveform, copied
+//			count		The number of steps
+//			loops		How often to play it, 0 until uio48sim_stop()
+//
+// Returns:
+//			-1		If the chip does not exist or the thread cannot be
+//					started
+//	or		0		On success
+//
+//------------------------------------------------------------------------
+//
+int uio48sim_play(int chip_number, const struct uio48_wave_step *steps,
+				  int count, int loops)
+{
+	struct sim_chip *c;
+	struct uio48_wave_step *copy;
+
+	if(count <= 0 || uio48sim_stop(chip_number))
+		return -1;
+
+	copy = malloc(count * sizeof(*copy));
+
+	if(copy == NULL)
+		return -1;
+
+	memcpy(copy, steps, count * sizeof(*copy));
+
+	c = &chips[chip_number - 1];
+
+	pthread_mutex_lock(&c->lock);
+
+	free(c->steps);
+	c->steps = copy;
+	c->count = count;
+	c->loops = loops;
+	c->stop = 0;
+
+	if(pthread_create(&c->player, NULL, sim_player, c) == 0)
+		c->playing = 1;
+
+	pthread_mutex_unlock(&c->lock);
+
+	return c->playing ? 0 : -1;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48sim_stop - Stop a waveform.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			-1		If the chip does not exist
+//	or		0		On success, also if nothing was playing
+//
+//------------------------------------------------------------------------
+//
+int uio48sim_stop(int chip_number)
+{
+	struct sim_chip *c;
+
+	if(sim_open(chip_number - 1) < 0)
+		return -1;
+
+	c = &chips[chip_number - 1];
+
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_broadcast(&c->player_cv);
+	pthread_mutex_unlock(&c->lock);
+
+	return uio48sim_wait(chip_number);
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48sim_wait - Wait for a waveform to finish playing.
+//
+// Arguments:
+//			chip_number	The 1 based index of the chip
+//
+// Returns:
+//			-1		If the chip does not exist
+//	or		0		On success, also if nothing was playing
+//
+//------------------------------------------------------------------------
+//
+int uio48sim_wait(int chip_number)
+{
+	struct sim_chip *c;
+	pthread_t player;
+	int playing;
+
+	if(sim_open(chip_number - 1) < 0)
+		return -1;
+
+	c = &chips[chip_number - 1];
+
+	pthread_mutex_lock(&c->lock);
+	playing = c->playing;
+	player = c->player;
+	c->playing = 0;
+	pthread_mutex_unlock(&c->lock);
+
+	if(playing)
+		pthread_join(player, NULL);
+
+	return 0;
+}
+
+// A chip's records sorted by time, see uio48sim_replay()
+struct sim_order {
+	unsigned long long timestamp;
+	size_t index;
+};
+
+static int sim_order_cmp(const void *a, const void *b)
+{
+	const struct sim_order *x = a, *y = b;
+
+	if(x->timestamp != y->timestamp)
+		return x->timestamp < y->timestamp ? -1 : 1;
+
+	// keep the file order of records stamped alike
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+//
+//------------------------------------------------------------------------
+//
+// uio48sim_replay - Play a recorded trace into the simulated chips.
+//
+// Description:		The trace written by uio48-record is turned into one
+//					waveform per recorded chip and started with
+//					uio48sim_play(), so the chips see the recorded input
+//					levels and raise the recorded edges again, scaled in
+//					time by 1/speed. An edge to the level a bit already
+//					has is preceded by a step to the opposite level, so
+//					every recorded event is raised again. Each chip's
+//					records are sorted by time first. Setting
+//					UIO48_SIM_REPLAY to a trace file (and optionally
+//					UIO48_SIM_SPEED) replays it when the application
+//					first opens a simulated chip.
+//
+// Arguments:
+//			path		The trace file
+//			speed		Time scale, 1.0 for the original timing
+//			loops		How often to play it, 0 until uio48sim_stop()
+//
+// Returns:
+//			-1		If the file is not a valid trace or a waveform
+//					cannot be started
+//	or		The number of chips replaying
+//
+//------------------------------------------------------------------------
+//
+int uio48sim_replay(const char *path, double speed, int loops)
+{
+	const struct uio48_trace_header *hdr;
+	const struct uio48_trace_record *rec;
+	struct uio48_wave_step *steps;
+	struct sim_order *order;
+	unsigned long long last, levels, bit;
+	struct stat st;
+	void *map;
+	size_t count, i, k, m;
+	int fd, chip, n, started = 0;
+
+	if(speed <= 0)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if(fd < 0)
+		return -1;
+
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr))
+	{
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	rec = (const struct uio48_trace_record *)(hdr + 1);
+	count = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+
+	if(hdr->magic != UIO48_TRACE_MAGIC || hdr->version != UIO48_TRACE_VERSION ||
+	   hdr->record_size != sizeof(*rec))
+	{
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	// Worst case two steps per record
+	steps = malloc((2 * count + 1) * sizeof(*steps));
+	order = malloc((count + 1) * sizeof(*order));
+
+	if(steps == NULL || order == NULL)
+	{
+		free(steps);
+		free(order);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	for(chip = 0; chip < MAX_CHIPS; chip++)
+	{
+		if(!((hdr->chips >> chip) & 1))
+			continue;
+
+		last = hdr->start_ns;
+		levels = 0;
+		n = 0;
+
+		// Snapshots are written as they are taken and events when they
+		// are read, so a chip's records are only in time order once sorted
+		for(i = m = 0; i < count; i++)
+		{
+			if(rec[i].chip == chip)
+			{
+				order[m].timestamp = rec[i].timestamp;
+				order[m].index = i;
+				m++;
+			}
+		}
+
+		qsort(order, m, sizeof(*order), sim_order_cmp);
+
+		for(k = 0; k < m; k++)
+		{
+			i = order[k].index;
+
+			if(rec[i].type == UIO48_TRACE_SNAPSHOT)
+			{
+				levels = 0;
+
+				for(bit = 0; bit < 6; bit++)
+					levels |= (unsigned long long)rec[i].ports[bit] << (bit * 8);
+
+				steps[n].mask = UIO48_ALL_BITS;
+			}
+			else if(rec[i].type == UIO48_TRACE_EVENT &&
+					(rec[i].flags & (UIO48_EVENT_RISING | UIO48_EVENT_FALLING)) &&
+					rec[i].bit >= 1 && rec[i].bit <= 48)
+			{
+				bit = UIO48_BIT(rec[i].bit);
+
+				// Move away from the event's level first, or there is no edge
+				if(!!(levels & bit) == !!(rec[i].flags & UIO48_EVENT_RISING))
+				{
+					levels ^= bit;
+					steps[n].delay_ns = rec[i].timestamp > last ?
+						(rec[i].timestamp - last) / speed : 0;
+					steps[n].mask = bit;
+					steps[n].value = levels;
+					last = rec[i].timestamp;
+					n++;
+				}
+
+				levels ^= bit;
+				steps[n].mask = bit;
+			}
+			else
+				continue;
+
+			steps[n].delay_ns = rec[i].timestamp > last ?
+				(rec[i].timestamp - last) / speed : 0;
+			steps[n].value = levels;
+			last = rec[i].timestamp;
+			n++;
+		}
+
+		if(n == 0)
+			continue;
+
+		if(uio48sim_play(chip + 1, steps, n, loops) < 0)
+		{
+			started = -1;
+			break;
+		}
+
+		started++;
+	}
+
+	free(steps);
+	free(order);
+	munmap(map, st.st_size);
+
+	return started;
+}
+